@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace TaskSystemBenchmark {
+
+typedef std::chrono::steady_clock Clock;
+
+/// Seconds elapsed since @start
+inline double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/// Thread counts to run each benchmark with, powers of 2 up to the hardware concurrency or the --threads option
+std::vector<int> benchmarkThreadCounts();
+
+/// Check if the benchmark was selected with the --filter option, all are selected without it
+/// @param name - name of the benchmark, for example "raytracer/HeavyMesh"
+bool benchmarkEnabled(const std::string &name);
+
+/// Record a measured value for the JSON output, the benchmarks print their own tables
+/// @param unit - what the value measures, higher is better for rates and lower for times
+void report(const std::string &benchmark, int threads, const std::string &metric, double value, const std::string &unit);
+
+/// Compare the per ExecuteStep scheduling overhead of the ThreadManager with the original
+/// single mutex + condition_variable implementation
+void benchStepOverhead();
+
+/// Rate of scheduling tiny tasks through the TaskSystemExecutor, by executor name and by pre-resolved handle,
+/// and the rate they are completed at. Initializes the TaskSystemExecutor, so it runs after the other benchmarks
+void benchSubmission();
+
+/// Latency of a root task fanning out to many empty tasks that are joined by a single task
+void benchFanOut();
+
+/// Samples per second of each Raytracer scene, skipped if the Raytracer executor was not built
+void benchRaytracer();
+
+};
@@ -0,0 +1,69 @@
+#include "Benchmark.h"
+#include "Noop.h"
+#include "TaskSystem.h"
+
+#include <vector>
+#include <cstdio>
+#include <algorithm>
+
+using namespace TaskSystem;
+
+namespace TaskSystemBenchmark {
+
+void benchFanOut() {
+    const int rounds = 100;
+    const int widths[] = {16, 256, 4096};
+
+    printf("Fan-out/fan-in: root -> N empty tasks -> join, microseconds from scheduling the root to the join finishing\n");
+    printf("%8s %8s %12s %12s %12s\n", "threads", "width", "mean", "p50", "p99");
+    for (int threadCount : benchmarkThreadCounts()) {
+        TaskSystemExecutor::Init(threadCount);
+        TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+        const ExecutorType noop = ts.Register("benchmark-noop", &NoopConstructor);
+
+        for (int width : widths) {
+            std::vector<double> latencies;
+            std::vector<TaskID> children;
+            children.reserve(width);
+            for (int round = 0; round < rounds; round++) {
+                children.clear();
+                const Clock::time_point start = Clock::now();
+                const TaskID root = ts.ScheduleTask(noop, std::make_unique<NoopTask>(0), 0);
+                for (int c = 0; c < width; c++) {
+                    children.push_back(ts.ScheduleTask(noop, std::make_unique<NoopTask>(c), 0, std::span<const TaskID>(&root, 1)));
+                }
+                const TaskID join = ts.ScheduleTask(noop, std::make_unique<NoopTask>(0), 0, children);
+                ts.WaitForTask(join);
+                latencies.push_back(secondsSince(start) * 1e6);
+            }
+
+            std::sort(latencies.begin(), latencies.end());
+            double mean = 0;
+            for (double latency : latencies) {
+                mean += latency;
+            }
+            mean /= latencies.size();
+            const double p50 = latencies[latencies.size() / 2];
+            const double p99 = latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+
+            printf("%8d %8d %12.1f %12.1f %12.1f\n", threadCount, width, mean, p50, p99);
+            const std::string benchmark = "fan-out/" + std::to_string(width);
+            report(benchmark, threadCount, "mean", mean, "us");
+            report(benchmark, threadCount, "p50", p50, "us");
+            report(benchmark, threadCount, "p99", p99, "us");
+        }
+
+        // totals over all widths, polling workers show up as spin hits instead of parks and wakes
+        const IdleStats idle = ThreadManager::GetInstance().getIdleStats();
+        printf("%8d idle: %llu spin hits, %llu parks, %llu wakes, wake p50/p99 %.1f/%.1f us, dispatch p50/p99 %.1f/%.1f us\n",
+            threadCount, (unsigned long long)idle.spinHits, (unsigned long long)idle.parks, (unsigned long long)idle.wakes,
+            idle.wakeP50Ns * 1e-3, idle.wakeP99Ns * 1e-3, idle.dispatchP50Ns * 1e-3, idle.dispatchP99Ns * 1e-3);
+        report("fan-out/idle", threadCount, "spin hits", double(idle.spinHits), "count");
+        report("fan-out/idle", threadCount, "parks", double(idle.parks), "count");
+        report("fan-out/idle", threadCount, "wake p99", idle.wakeP99Ns * 1e-3, "us");
+        report("fan-out/idle", threadCount, "dispatch p50", idle.dispatchP50Ns * 1e-3, "us");
+        report("fan-out/idle", threadCount, "dispatch p99", idle.dispatchP99Ns * 1e-3, "us");
+    }
+}
+
+};
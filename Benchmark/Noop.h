@@ -0,0 +1,41 @@
+#pragma once
+
+#include "Task.h"
+#include "Executor.h"
+
+#include <memory>
+#include <string>
+#include <optional>
+
+namespace TaskSystemBenchmark {
+
+/// Task for the "benchmark-noop" executor, the "value" param is looked up by name
+struct NoopTask : TaskSystem::Task {
+    explicit NoopTask(int value) : value(value) {}
+
+    virtual std::optional<int> GetIntParam(const std::string &name) const {
+        if (name == "value") {
+            return value;
+        }
+        return std::nullopt;
+    }
+
+    virtual std::string GetExecutorName() const { return "benchmark-noop"; }
+
+    int value;
+};
+
+/// Executor that stops on its first step, measures only the cost of getting a task through the system
+struct NoopExecutor : TaskSystem::Executor {
+    NoopExecutor(std::unique_ptr<TaskSystem::Task> taskToExecute) : Executor(std::move(taskToExecute)) {}
+
+    virtual ExecStatus ExecuteStep(int, int) {
+        return ES_Stop;
+    }
+};
+
+inline TaskSystem::Executor *NoopConstructor(std::unique_ptr<TaskSystem::Task> taskToExecute) {
+    return new NoopExecutor(std::move(taskToExecute));
+}
+
+};
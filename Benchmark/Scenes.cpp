@@ -0,0 +1,70 @@
+#include "Benchmark.h"
+#include "TaskSystem.h"
+
+#include <vector>
+#include <string>
+#include <cstdio>
+
+using namespace TaskSystem;
+
+namespace TaskSystemBenchmark {
+
+/// Render @sceneName once and wait for it
+/// @return number of samples traced and the seconds it took
+static std::pair<int64_t, double> renderScene(TaskSystemExecutor &ts, const std::string &sceneName) {
+    const ExecutorType raytracer = ts.FindExecutorType("raytracer");
+    const ParamSchema &schema = ts.GetSchema(raytracer);
+    const ParamSlot<std::string> sceneParam{schema.Find("sceneName")};
+    const ParamSlot<void *> samplesParam{schema.Find("samplesOut")};
+
+    int64_t samples = 0;
+    std::unique_ptr<ParamTask> task = ts.MakeTask(raytracer);
+    task->Set(sceneParam, sceneName).Set(samplesParam, &samples);
+
+    const Clock::time_point start = Clock::now();
+    ts.WaitForTask(ts.ScheduleTask(raytracer, std::move(task), 0));
+    return {samples, secondsSince(start)};
+}
+
+void benchRaytracer() {
+    const std::string scenes[] = {"Example", "HeavyMesh", "ManySimpleMeshes", "ManyHeavyMeshes"};
+
+    std::vector<std::string> enabled;
+    for (const std::string &scene : scenes) {
+        if (benchmarkEnabled("raytracer/" + scene)) {
+            enabled.push_back(scene);
+        }
+    }
+    if (enabled.empty()) {
+        return;
+    }
+
+    const std::vector<int> threadCounts = benchmarkThreadCounts();
+    for (int threadCount : threadCounts) {
+        TaskSystemExecutor::Init(threadCount);
+        TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+        // the library is loaded by the first render, only the manifests are read here
+        ts.ScanPlugins(TS_PLUGIN_DIR);
+        if (!ts.FindExecutorType("raytracer").IsValid()) {
+            printf("Raytracer scenes skipped, the executor was not built\n");
+            return;
+        }
+        if (threadCount == threadCounts.front()) {
+            printf("Raytracer scenes, samples per second\n");
+            printf("%8s %18s %14s %10s\n", "threads", "scene", "samples/s", "seconds");
+        }
+
+        for (const std::string &scene : enabled) {
+            if (threadCount == threadCounts.front()) {
+                // meshes are loaded and accelerators built once, the timed renders all start with warm geometry
+                renderScene(ts, scene);
+            }
+            const auto [samples, seconds] = renderScene(ts, scene);
+            const double rate = samples / seconds;
+            printf("%8d %18s %14.0f %10.2f\n", threadCount, scene.c_str(), rate, seconds);
+            report("raytracer/" + scene, threadCount, "samples", rate, "samples/s");
+        }
+    }
+}
+
+};
@@ -0,0 +1,165 @@
+#include "Benchmark.h"
+#include "Executor.h"
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <condition_variable>
+
+using namespace TaskSystem;
+
+namespace TaskSystemBenchmark {
+
+/// The original ThreadManager, kept as a baseline: one mutex + condition_variable shared by
+/// all workers, each runThreads call executes exactly one step on every thread
+class LegacyThreadManager {
+public:
+	explicit LegacyThreadManager(int threadCount)
+		: count(threadCount)
+	{}
+
+	void start() {
+		running = true;
+		currentTask.resize(count, nullptr);
+		for (int c = 0; c < count; c++) {
+			threads.emplace_back(&LegacyThreadManager::threadBase, this, c);
+		}
+	}
+
+	void runThreads(Executor &task) {
+		{
+			std::lock_guard<std::mutex> lock(workMtx);
+			for (int c = 0; c < int(currentTask.size()); c++) {
+				currentTask[c] = &task;
+			}
+		}
+		workEvent.notify_all();
+
+		std::unique_lock<std::mutex> lock(workMtx);
+		workEvent.wait(lock, [this]() {
+			return unlockedAllTasksDone();
+		});
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(workMtx);
+			running = false;
+		}
+		workEvent.notify_all();
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+	}
+
+private:
+	void threadBase(int threadIndex) {
+		while (true) {
+			Executor *toExecute = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(workMtx);
+				workEvent.wait(lock, [this, threadIndex]() {
+					return currentTask[threadIndex] != nullptr || !running;
+				});
+				if (!running) {
+					return;
+				}
+				toExecute = currentTask[threadIndex];
+			}
+
+			toExecute->ExecuteStep(threadIndex, count);
+			{
+				std::lock_guard<std::mutex> lock(workMtx);
+				currentTask[threadIndex] = nullptr;
+			}
+			workEvent.notify_all();
+		}
+	}
+
+	bool unlockedAllTasksDone() const {
+		for (Executor *task : currentTask) {
+			if (task) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	int count;
+	std::vector<std::thread> threads;
+	bool running = false;
+	std::vector<Executor *> currentTask;
+	std::mutex workMtx;
+	std::condition_variable workEvent;
+};
+
+/// Executor with a single empty step, every step measured goes through the dispatch of the scheduler
+struct OneStepExecutor : Executor {
+	OneStepExecutor() : Executor(nullptr) {
+		maxThreads = 1;
+	}
+
+	virtual ExecStatus ExecuteStep(int, int) {
+		return ES_Stop;
+	}
+};
+
+/// Both managers run the same rounds: one empty step dispatched to each thread, then wait for all of them
+/// The legacy one does it with a runThreads call, the ThreadManager by scheduling one single step executor per thread
+void benchStepOverhead() {
+	const int64_t rounds = 20000;
+
+	printf("ExecuteStep dispatch overhead, ns per step\n");
+	printf("%8s %12s %14s\n", "threads", "legacy", "work-stealing");
+	for (int threadCount : benchmarkThreadCounts()) {
+		const int64_t steps = rounds * threadCount;
+
+		double legacyNs = 0;
+		{
+			LegacyThreadManager legacy(threadCount);
+			legacy.start();
+			OneStepExecutor executor;
+			const Clock::time_point start = Clock::now();
+			for (int64_t c = 0; c < rounds; c++) {
+				legacy.runThreads(executor);
+			}
+			legacyNs = secondsSince(start) * 1e9 / steps;
+			legacy.stop();
+		}
+
+		double stealingNs = 0;
+		{
+			ThreadManager::Init(threadCount);
+			ThreadManager &tm = ThreadManager::GetInstance();
+			tm.start();
+			// new executors every round, one is only done with once its finish callback returned
+			std::vector<std::unique_ptr<OneStepExecutor>> executors(threadCount);
+			std::atomic<int> finished = 0;
+			const Clock::time_point start = Clock::now();
+			for (int64_t c = 0; c < rounds; c++) {
+				finished.store(0);
+				for (std::unique_ptr<OneStepExecutor> &executor : executors) {
+					executor.reset(new OneStepExecutor);
+					tm.runThreadsNoWait(*executor, 0, 1, [&finished]() {
+						finished.fetch_add(1);
+						finished.notify_one();
+					});
+				}
+				for (int done = finished.load(); done < threadCount; done = finished.load()) {
+					finished.wait(done);
+				}
+			}
+			stealingNs = secondsSince(start) * 1e9 / steps;
+			tm.stop();
+		}
+
+		printf("%8d %12.1f %14.1f\n", threadCount, legacyNs, stealingNs);
+		report("step-overhead", threadCount, "legacy", legacyNs, "ns/step");
+		report("step-overhead", threadCount, "work-stealing", stealingNs, "ns/step");
+	}
+}
+
+};
@@ -0,0 +1,61 @@
+#include "Benchmark.h"
+#include "Noop.h"
+#include "TaskSystem.h"
+
+#include <vector>
+#include <cstdio>
+
+using namespace TaskSystem;
+
+namespace TaskSystemBenchmark {
+
+void benchSubmission() {
+    const int taskCount = 100000;
+
+    printf("Task submission from a single thread, tasks per second\n");
+    printf("%8s %14s %14s %14s %14s\n", "threads", "by name", "by handle", "param task", "completed");
+    for (int threadCount : benchmarkThreadCounts()) {
+        TaskSystemExecutor::Init(threadCount);
+        TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+        ParamSchema schema;
+        const ParamSlot<int> value = schema.Add<int>("value", true);
+        const ExecutorType noop = ts.Register("benchmark-noop", &NoopConstructor, std::move(schema));
+
+        std::vector<TaskID> ids;
+        ids.reserve(taskCount);
+
+        Clock::time_point start = Clock::now();
+        for (int c = 0; c < taskCount; c++) {
+            ids.push_back(ts.ScheduleTask(std::make_unique<NoopTask>(c), 0));
+        }
+        const double byName = taskCount / secondsSince(start);
+        ts.WaitForAll(ids);
+        ids.clear();
+
+        start = Clock::now();
+        for (int c = 0; c < taskCount; c++) {
+            ids.push_back(ts.ScheduleTask(noop, std::make_unique<NoopTask>(c), 0));
+        }
+        const double byHandle = taskCount / secondsSince(start);
+        ts.WaitForAll(ids);
+        ids.clear();
+
+        start = Clock::now();
+        for (int c = 0; c < taskCount; c++) {
+            std::unique_ptr<ParamTask> task = ts.MakeTask(noop);
+            task->Set(value, c);
+            ids.push_back(ts.ScheduleTask(noop, std::move(task), 0));
+        }
+        const double paramTask = taskCount / secondsSince(start);
+        ts.WaitForAll(ids);
+        const double completed = taskCount / secondsSince(start);
+
+        printf("%8d %14.0f %14.0f %14.0f %14.0f\n", threadCount, byName, byHandle, paramTask, completed);
+        report("submission", threadCount, "by-name", byName, "tasks/s");
+        report("submission", threadCount, "by-handle", byHandle, "tasks/s");
+        report("submission", threadCount, "param-task", paramTask, "tasks/s");
+        report("submission", threadCount, "completed", completed, "tasks/s");
+    }
+}
+
+};
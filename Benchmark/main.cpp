@@ -0,0 +1,97 @@
+#include "Benchmark.h"
+#include "Trace.h"
+
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+namespace TaskSystemBenchmark {
+
+/// One value passed to @report
+struct Result {
+    std::string benchmark;
+    int threads;
+    std::string metric;
+    double value;
+    std::string unit;
+};
+
+static std::vector<Result> results;
+static std::string filter; ///< Substring of the benchmark names to run, empty runs all
+static int maxThreads = 0; ///< Limit of the thread counts, 0 uses the hardware concurrency
+
+std::vector<int> benchmarkThreadCounts() {
+    const int hardware = std::max(1, int(std::thread::hardware_concurrency()));
+    const int limit = maxThreads > 0 ? maxThreads : hardware;
+    std::vector<int> counts;
+    for (int c = 1; c < limit; c *= 2) {
+        counts.push_back(c);
+    }
+    counts.push_back(limit);
+    return counts;
+}
+
+bool benchmarkEnabled(const std::string &name) {
+    return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+void report(const std::string &benchmark, int threads, const std::string &metric, double value, const std::string &unit) {
+    results.push_back(Result{benchmark, threads, metric, value, unit});
+}
+
+/// Write all results as JSON, one object per value so two runs can be diffed line by line
+static bool writeJson(const std::string &path) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        printf("Failed to open [%s] for the results\n", path.c_str());
+        return false;
+    }
+    fprintf(file, "{\n  \"hardwareConcurrency\": %d,\n  \"tracing\": %s,\n  \"results\": [",
+        int(std::thread::hardware_concurrency()), TaskSystem::Trace::IsEnabled() ? "true" : "false");
+    for (int c = 0; c < int(results.size()); c++) {
+        const Result &result = results[c];
+        fprintf(file, "%s\n    {\"benchmark\": \"%s\", \"threads\": %d, \"metric\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}",
+            c ? "," : "", result.benchmark.c_str(), result.threads, result.metric.c_str(), result.value, result.unit.c_str());
+    }
+    fprintf(file, "\n  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+};
+
+int main(int argc, char *argv[]) {
+    using namespace TaskSystemBenchmark;
+
+    std::string jsonPath;
+    for (int c = 1; c < argc; c++) {
+        if (!strcmp(argv[c], "--json") && c + 1 < argc) {
+            jsonPath = argv[++c];
+        } else if (!strcmp(argv[c], "--filter") && c + 1 < argc) {
+            filter = argv[++c];
+        } else if (!strcmp(argv[c], "--threads") && c + 1 < argc) {
+            maxThreads = atoi(argv[++c]);
+        } else {
+            printf("Usage: %s [--json results.json] [--filter name] [--threads max]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (benchmarkEnabled("step-overhead")) {
+        benchStepOverhead();
+    }
+    if (benchmarkEnabled("submission")) {
+        benchSubmission();
+    }
+    if (benchmarkEnabled("fan-out")) {
+        benchFanOut();
+    }
+    // checks the filter for each scene
+    benchRaytracer();
+
+    if (!jsonPath.empty() && !writeJson(jsonPath)) {
+        return 1;
+    }
+    return 0;
+}
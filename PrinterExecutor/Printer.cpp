@@ -1,40 +1,32 @@
 #include "Task.h"
 #include "Executor.h"
 #include "TaskSystem.h"
+#include "ParallelFor.h"
 
 #include <chrono>
 #include <thread>
 #include <atomic>
 
-struct Printer : TaskSystem::Executor {
-    Printer(std::unique_ptr<TaskSystem::Task> taskToExecute) : Executor(std::move(taskToExecute)) {
-        max = task->GetIntParam("max").value();
-        sleepMs = task->GetIntParam("sleep").value();
-    }
+/// Slots of the parameters, declared when the library is loaded
+static TaskSystem::ParamSlot<int> maxParam;
+static TaskSystem::ParamSlot<int> sleepParam;
 
-    virtual ~Printer() {}
-
-    virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) {
-        const int myValue = current.fetch_add(1);
-        if (myValue >= max) {
-            current.fetch_sub(1);
-            return ExecStatus::ES_Stop;
-        }
+TaskSystem::Executor* ExecutorConstructorImpl(std::unique_ptr<TaskSystem::Task> taskToExecute) {
+    const TaskSystem::ParamBlock &params = taskToExecute->GetParams();
+    const int max = params.Get(maxParam).value();
+    const int sleepMs = params.Get(sleepParam).value();
+    const int threadCount = TaskSystem::ThreadManager::GetInstance().getThreadCount();
 
-        printf("Printer [%d/%d]: %d\n", threadIndex, threadCount, myValue);
+    return TaskSystem::MakeParallelFor(std::move(taskToExecute), 0, max, [sleepMs, threadCount](int64_t value, int threadIndex) {
+        printf("Printer [%d/%d]: %d\n", threadIndex, threadCount, int(value));
         std::this_thread::sleep_for(std::chrono::milliseconds(sleepMs));
-        return ExecStatus::ES_Continue;
-    };
-
-    std::atomic<int> current = 0;
-    int max = 0;
-    int sleepMs = 0;
-};
-
-TaskSystem::Executor* ExecutorConstructorImpl(std::unique_ptr<TaskSystem::Task> taskToExecute) {
-    return new Printer(std::move(taskToExecute));
+    });
 }
 
 IMPLEMENT_ON_INIT() {
-    ts.Register("printer", &ExecutorConstructorImpl);
+    TaskSystem::ParamSchema schema;
+    maxParam = schema.Add<int>("max", true);
+    sleepParam = schema.Add<int>("sleep", true);
+    // the steps sleep, they run on the blocking pool
+    ts.Register("printer", &ExecutorConstructorImpl, std::move(schema), TaskSystem::EC_Blocking);
 }
@@ -0,0 +1,108 @@
+#include "GeometryCache.h"
+
+#include <cstdio>
+#include <filesystem>
+
+GeometryCache &GeometryCache::GetInstance() {
+	static GeometryCache cache;
+	return cache;
+}
+
+std::string GeometryCache::fileFingerprint(const std::string &path) {
+	std::error_code error;
+	const uintmax_t size = std::filesystem::file_size(path, error);
+	if (error) {
+		return std::string();
+	}
+	const std::filesystem::file_time_type modified = std::filesystem::last_write_time(path, error);
+	if (error) {
+		return std::string();
+	}
+	return std::to_string(size) + "@" + std::to_string(modified.time_since_epoch().count());
+}
+
+void GeometryCache::setBudget(size_t bytes) {
+	std::lock_guard<std::mutex> lock(mtx);
+	budget = bytes;
+	unlockedEvict();
+}
+
+std::shared_ptr<void> GeometryCache::lookupAny(const std::string &key) {
+	std::lock_guard<std::mutex> lock(mtx);
+	auto it = entries.find(key);
+	if (it == entries.end() || !it->second->value) {
+		return nullptr;
+	}
+	it->second->lastUse = ++useCounter;
+	return it->second->value;
+}
+
+std::shared_ptr<void> GeometryCache::acquireAny(const std::string &key, const std::function<std::shared_ptr<void>(size_t &)> &build) {
+	std::shared_ptr<Entry> entry;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		std::shared_ptr<Entry> &slot = entries[key];
+		if (!slot) {
+			slot = std::make_shared<Entry>();
+		}
+		slot->lastUse = ++useCounter;
+		if (slot->value) {
+			return slot->value;
+		}
+		entry = slot;
+	}
+
+	size_t bytes = 0;
+	std::shared_ptr<void> value = build(bytes);
+
+	std::lock_guard<std::mutex> lock(mtx);
+	if (entry->value) {
+		// built by a call that was not ordered after this one, the first value is kept
+		return entry->value;
+	}
+	entry->value = value;
+	entry->bytes = bytes;
+	entry->building.reset();
+	totalBytes += bytes;
+	unlockedEvict();
+	printf("Geometry cache: built [%s], %zu MB cached\n", key.c_str(), totalBytes >> 20);
+	return value;
+}
+
+TaskSystem::TaskID GeometryCache::scheduleBuild(const std::string &key, const std::function<TaskSystem::TaskID(std::span<const TaskSystem::TaskID>)> &schedule) {
+	std::lock_guard<std::mutex> lock(mtx);
+	std::shared_ptr<Entry> &slot = entries[key];
+	if (!slot) {
+		slot = std::make_shared<Entry>();
+	}
+	if (slot->building) {
+		// the task only starts once the value is cached, it picks it up without building
+		const TaskSystem::TaskID running = *slot->building;
+		return schedule(std::span<const TaskSystem::TaskID>(&running, 1));
+	}
+	const TaskSystem::TaskID task = schedule(std::span<const TaskSystem::TaskID>());
+	if (!slot->value) {
+		slot->building = task;
+	}
+	return task;
+}
+
+void GeometryCache::unlockedEvict() {
+	while (totalBytes > budget) {
+		auto oldest = entries.end();
+		for (auto it = entries.begin(); it != entries.end(); ++it) {
+			// new references are only made with the mutex locked, a single owner means no task holds the value
+			const Entry &entry = *it->second;
+			if (entry.value && entry.value.use_count() == 1 && (oldest == entries.end() || entry.lastUse < oldest->second->lastUse)) {
+				oldest = it;
+			}
+		}
+		if (oldest == entries.end()) {
+			return;
+		}
+
+		printf("Geometry cache: evicted [%s]\n", oldest->first.c_str());
+		totalBytes -= oldest->second->bytes;
+		entries.erase(oldest);
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <span>
+#include <mutex>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <utility>
+#include <optional>
+#include <functional>
+#include <unordered_map>
+#include "Task.h"
+
+/// Process wide cache of loaded and built scene geometry, shared read-only between render tasks
+/// Values are reference counted, only the ones no task holds anymore are evicted when over the memory budget
+/// Nothing is kept on disk, each process parses the OBJ files once: TriangleMesh in urban-spork only loads
+/// from an OBJ path and owns its vertex and accelerator layout, so there is no binary form to write or map back
+class GeometryCache {
+public:
+	static GeometryCache &GetInstance();
+
+	/// Get the value for @key, calling @build to create it if it is not cached
+	/// Nothing is locked while building, concurrent calls for the same key would build it twice, run the builds
+	/// as tasks scheduled with @scheduleBuild to build it once
+	/// @param build - callable with signature std::shared_ptr<T>(size_t &bytes), sets the approximate memory of the value
+	template <typename Build>
+	auto acquire(const std::string &key, Build &&build) -> decltype(build(std::declval<size_t &>())) {
+		typedef typename decltype(build(std::declval<size_t &>()))::element_type Value;
+		std::shared_ptr<void> value = acquireAny(key, [&build](size_t &bytes) -> std::shared_ptr<void> {
+			return build(bytes);
+		});
+		return std::static_pointer_cast<Value>(value);
+	}
+
+	/// Get the value for @key if it is already built, without building it
+	/// @return the value or nullptr if it is not cached or still being built
+	template <typename T>
+	std::shared_ptr<T> lookup(const std::string &key) {
+		return std::static_pointer_cast<T>(lookupAny(key));
+	}
+
+	/// Schedule the task that builds @key, after the one already building it if there is one
+	/// @param schedule - schedules the task with the given predecessors: the running build of @key, or none if there
+	///                   is no running build, then the task is remembered as the build of @key until it stores the value
+	/// @return the task returned by @schedule, the value is cached once it finishes
+	TaskSystem::TaskID scheduleBuild(const std::string &key, const std::function<TaskSystem::TaskID(std::span<const TaskSystem::TaskID>)> &schedule);
+
+	/// Identify the current contents of a source file by its size and modification time, cheap enough to be
+	/// part of every cache key so geometry built from a file that changed since is rebuilt
+	/// @return empty string if the file can't be accessed
+	static std::string fileFingerprint(const std::string &path);
+
+	/// Set the maximum approximate memory of the cached values, unused values over it are evicted
+	void setBudget(size_t bytes);
+
+private:
+	struct Entry {
+		std::shared_ptr<void> value; ///< Empty until built, protected by the cache mutex
+		std::optional<TaskSystem::TaskID> building; ///< Task scheduled to build the value, until it is stored
+		size_t bytes = 0;
+		uint64_t lastUse = 0;
+	};
+
+	std::shared_ptr<void> lookupAny(const std::string &key);
+	std::shared_ptr<void> acquireAny(const std::string &key, const std::function<std::shared_ptr<void>(size_t &)> &build);
+
+	/// Drop the least recently used values not held by any task until under budget, must be called with @mtx locked
+	void unlockedEvict();
+
+	std::mutex mtx; ///< Protects all members and the values of all entries
+	std::unordered_map<std::string, std::shared_ptr<Entry>> entries;
+	size_t budget = size_t(2) << 30;
+	size_t totalBytes = 0;
+	uint64_t useCounter = 0;
+};
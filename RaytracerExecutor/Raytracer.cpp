@@ -5,12 +5,14 @@
 #include "Task.h"
 #include "Executor.h"
 #include "TaskSystem.h"
+#include "ParallelFor.h"
 
 #include "Threading.hpp"
 #include "Material.h"
 #include "Primitive.h"
 #include "Image.hpp"
 #include "Mesh.h"
+#include "GeometryCache.h"
 
 #include "third_party/stb_image_write.h"
 
@@ -20,7 +22,12 @@
 #include <vector>
 #include <cmath>
 #include <iostream>
+#include <mutex>
 #include <atomic>
+#include <algorithm>
+#include <typeinfo>
+#include <memory_resource>
+#include <filesystem>
 
 /// Camera description, can be pointed at point, used to generate screen rays
 struct Camera {
@@ -50,39 +57,176 @@ struct Camera {
 	}
 };
 
-vec3 raytrace(const Ray &r, Instancer &prims, int depth = 0) {
-	Intersection data;
-	if (prims.intersect(r, 0.001f, FLT_MAX, data)) {
-		Ray scatter;
-		Color attenuation;
-		if (depth < MAX_RAY_DEPTH && data.material->shade(r, data, attenuation, scatter)) {
-			const Color incoming = raytrace(scatter, prims, depth + 1);
-			return attenuation * incoming;
-		} else {
-			return Color(0.f);
-		}
-	}
+/// Color of rays that escape the scene
+vec3 background(const Ray &r) {
 	const vec3 dir = r.dir;
 	const float f = 0.5f * (dir.y + 1.f);
 	return (1.f - f) * vec3(1.f) + f * vec3(0.5f, 0.7f, 1.f);
 }
 
+/// A sample being traced, @throughput is the product of the attenuations of all bounces so far
+struct PathState {
+	Ray ray;
+	Color throughput;
+	int pixel; ///< Index of the pixel in the tile the sample contributes to
+};
+
+/// Intersection of a path, tagged with the type of the material that has to shade it
+struct PathHit {
+	Intersection data;
+	const std::type_info *materialType;
+	int path;
+};
+
+/// Memory of the per pixel buffers, every worker steps tiles all over the image so the pages are interleaved
+/// over the NUMA nodes instead of all landing on the node of the thread that created the scene
+std::pmr::memory_resource &imageMemory() {
+	static TaskSystem::NodeMemoryResource interleaved(-1);
+	return interleaved;
+}
+
+/// Per worker memory for the transient state of a tile, everything is released at once before the next tile
+std::pmr::monotonic_buffer_resource &tileArena() {
+	thread_local std::vector<std::byte> buffer(4 << 20);
+	thread_local std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size());
+	return arena;
+}
+
+/// Trace all paths bounce by bounce until they escape or get terminated, adding their contribution to @accumulated
+/// All paths are intersected first, then shaded grouped by material so each shade implementation runs back to back.
+/// Paths that get past MAX_RAY_DEPTH bounces are terminated with russian roulette instead of a hard depth limit.
+void tracePaths(Instancer &prims, std::pmr::vector<PathState> &paths, std::pmr::vector<Color> &accumulated, std::pmr::memory_resource &arena) {
+	std::pmr::vector<PathHit> hits(&arena);
+	hits.reserve(paths.size());
+	std::pmr::vector<PathState> next(&arena);
+	next.reserve(paths.size());
+
+	for (int depth = 0; !paths.empty(); depth++) {
+		hits.clear();
+		for (int c = 0; c < int(paths.size()); c++) {
+			PathHit hit;
+			hit.path = c;
+			if (prims.intersect(paths[c].ray, 0.001f, FLT_MAX, hit.data)) {
+				hit.materialType = &typeid(*hit.data.material);
+				hits.push_back(hit);
+			} else {
+				accumulated[paths[c].pixel] += paths[c].throughput * background(paths[c].ray);
+			}
+		}
+
+		std::sort(hits.begin(), hits.end(), [](const PathHit &a, const PathHit &b) {
+			if (*a.materialType != *b.materialType) {
+				return a.materialType->before(*b.materialType);
+			}
+			return std::less<const Material *>()(&*a.data.material, &*b.data.material);
+		});
+
+		next.clear();
+		for (const PathHit &hit : hits) {
+			const PathState &path = paths[hit.path];
+			Ray scatter;
+			Color attenuation;
+			if (!hit.data.material->shade(path.ray, hit.data, attenuation, scatter)) {
+				continue;
+			}
+
+			Color throughput = path.throughput * attenuation;
+			if (depth + 1 >= MAX_RAY_DEPTH) {
+				const float survival = std::min(1.f, std::max({throughput.x, throughput.y, throughput.z}));
+				if (survival <= 0.f || randFloat() >= survival) {
+					continue;
+				}
+				throughput = (1.f / survival) * throughput;
+			}
+			next.push_back(PathState{scatter, throughput, path.pixel});
+		}
+		paths.swap(next);
+	}
+}
+
+/// Destination of the progressive snapshots of one render, serializes the writes and drops snapshots
+/// older than the last one written, since background writers can finish out of order
+struct SnapshotSink {
+	explicit SnapshotSink(std::string path) : path(std::move(path)) {}
+
+	/// Encode and write @image if it has more passes than the last written one
+	void write(int pass, ImageData &image, int width, int height) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (pass <= lastPass) {
+			return;
+		}
+		const PNGImage &png = image.createPNGData();
+		const int success = stbi_write_png(path.c_str(), width, height, PNGImage::componentCount(), png.data.data(), sizeof(PNGImage::Pixel) * width);
+		assert(success == 1);
+		lastPass = pass;
+	}
+
+	const std::string path;
+	std::mutex mutex;
+	int lastPass = 0; ///< Number of passes in the last written image
+};
+
+/// Parameter slots and handles of the executors in this library, set once when the library is loaded
+struct RaytracerLibrary {
+	TaskSystem::ParamSlot<std::string> sceneName;
+	TaskSystem::ParamSlot<int> tileSize;
+	TaskSystem::ParamSlot<void *> samplesOut;
+	TaskSystem::ParamSlot<void *> snapshot;
+	TaskSystem::ParamSlot<void *> build;
+	TaskSystem::ExecutorType snapshotWriter;
+	TaskSystem::ExecutorType geometryBuilder;
+};
+static RaytracerLibrary library;
+
+/// Copy of the image after a finished pass, owned by the task of the background writer
+struct Snapshot {
+	std::shared_ptr<SnapshotSink> sink;
+	int pass = 0;
+	int width = 0;
+	int height = 0;
+	ImageData image;
+};
+
+/// Task for the "raytracer-snapshot" executor, the snapshot is passed as the "snapshot" param
+struct SnapshotTask : TaskSystem::Task {
+	explicit SnapshotTask(std::unique_ptr<Snapshot> snapshot) : snapshot(std::move(snapshot)) {}
+
+	virtual std::optional<void*> GetAnyParam(const std::string &name) const {
+		if (name == "snapshot") {
+			return snapshot.get();
+		}
+		return std::nullopt;
+	}
+
+	virtual std::string GetExecutorName() const { return "raytracer-snapshot"; }
+
+	std::unique_ptr<Snapshot> snapshot;
+};
+
+/// Pixel bounds of a tile, end is exclusive
+struct TileRect {
+	int startX, startY;
+	int endX, endY;
+};
+
 struct Scene {
 	int width = 640;
 	int height = 480;
-	int samplesPerPixel = 2;
+	int samplesPerPixel = 2; ///< Number of passes, each pass adds one sample to every pixel
+	int tileSize = 32; ///< Width and height in pixels of the work item claimed by a single step
 	std::string name;
-	Instancer primitives;
+	std::shared_ptr<Instancer> primitives; ///< Shared with other tasks rendering the same scene, read-only
 	Camera camera;
-	ImageData image;
-	std::atomic<int> completedThreads = 0;
-
-	std::mutex initMutex;
-	std::vector<int> perThreadProgress;
+	ImageData image; ///< Average of the passes accumulated so far, each tile can be at a different pass
 
-	void onBeforeRender() {
-		primitives.onBeforeRender();
-	}
+	std::pmr::vector<Color> accumulation{&imageMemory()}; ///< Sum of all samples traced so far for each pixel
+	std::unique_ptr<int[]> tilePasses; ///< Number of passes accumulated in each tile, guarded by @tileLocks
+	std::unique_ptr<std::atomic<int>[]> passTiles; ///< Number of tiles that have accumulated at least that many passes
+	std::unique_ptr<std::mutex[]> tileLocks; ///< Guard the region of @image of each tile between its writer and snapshots
+	std::unique_ptr<TaskSystem::ParallelRange> items; ///< All (pass, tile) pairs, claimed in order by the threads
+	std::shared_ptr<SnapshotSink> sink;
+	int snapshotPriority = 0; ///< Priority of the background writer tasks
+	std::function<void(TaskSystem::TaskID)> onFinalImage; ///< Called with the writer task of the final image
 
 	void initImage(int w, int h, int spp) {
 		image.init(w, h);
@@ -92,85 +236,169 @@ struct Scene {
 		camera.aspect = float(width) / height;
 	}
 
-	void addPrimitive(PrimPtr primitive) {
-		primitives.addInstance(std::move(primitive));
+	/// Allocate the per pass state, must be called once the tile size is final
+	void initPasses(int priority, int threadCount) {
+		items.reset(new TaskSystem::ParallelRange(0, int64_t(tileCount()) * samplesPerPixel, threadCount));
+		accumulation.assign(size_t(width) * height, Color(0));
+		tilePasses.reset(new int[tileCount()]());
+		passTiles.reset(new std::atomic<int>[samplesPerPixel]());
+		tileLocks.reset(new std::mutex[tileCount()]);
+		sink = std::make_shared<SnapshotSink>(name + ".png");
+		snapshotPriority = priority;
 	}
 
-	bool renderStep(int threadIndex, int threadCount) {
-		if (perThreadProgress.empty()) {
-			std::lock_guard<std::mutex> lock(initMutex);
-			if (perThreadProgress.empty()) {
-				perThreadProgress.resize(threadCount, 0);
-				for (int c = 0; c < int(perThreadProgress.size()); c++) {
-					perThreadProgress[c] = c;
-				}
-			}
-		}
+	int tilesX() const {
+		return (width + tileSize - 1) / tileSize;
+	}
 
-		int &idx = perThreadProgress[threadIndex];
+	int tileCount() const {
+		return tilesX() * ((height + tileSize - 1) / tileSize);
+	}
 
-		if (idx >= width * height) {
-			if (completedThreads.load() == threadCount) {
-				return true;
-			} else {
-				return false;
+	TileRect tileRect(int tile) const {
+		TileRect rect;
+		rect.startX = (tile % tilesX()) * tileSize;
+		rect.startY = (tile / tilesX()) * tileSize;
+		rect.endX = std::min(rect.startX + tileSize, width);
+		rect.endY = std::min(rect.startY + tileSize, height);
+		return rect;
+	}
+
+	/// Add one sample to every pixel of the tile, primary rays are generated row by row so neighbouring rays
+	/// are traced back to back, and all paths of the tile are traced together, bounce by bounce
+	/// Rays are not traced in SIMD packets: intersection and the accelerators are in urban-spork and take one ray
+	/// Passes of a tile can finish in any order, each one is traced into its own buffer and only then added
+	/// @return number of passes accumulated in the tile, including this one
+	int renderTile(int tile) {
+		std::pmr::monotonic_buffer_resource &arena = tileArena();
+		arena.release();
+
+		const TileRect rect = tileRect(tile);
+		const int tileWidth = rect.endX - rect.startX;
+		std::pmr::vector<Color> accumulated(tileWidth * (rect.endY - rect.startY), Color(0), &arena);
+		std::pmr::vector<PathState> paths(&arena);
+		paths.reserve(accumulated.size());
+
+		for (int r = rect.startY; r < rect.endY; r++) {
+			for (int c = rect.startX; c < rect.endX; c++) {
+				const float u = float(c + randFloat()) / float(width);
+				const float v = float(r + randFloat()) / float(height);
+				paths.push_back(PathState{camera.getRay(u, v), Color(1.f), (r - rect.startY) * tileWidth + (c - rect.startX)});
 			}
 		}
 
-		const int r = idx / width;
-		const int c = idx % width;
+		tracePaths(*primitives, paths, accumulated, arena);
+
+		// other passes of the tile and snapshots can touch the same pixels
+		std::lock_guard<std::mutex> lock(tileLocks[tile]);
+		const int passes = ++tilePasses[tile];
+		for (int r = rect.startY; r < rect.endY; r++) {
+			for (int c = rect.startX; c < rect.endX; c++) {
+				Color &sum = accumulation[size_t(r) * width + c];
+				sum += accumulated[(r - rect.startY) * tileWidth + (c - rect.startX)];
+				Color avg = sum;
+				avg /= float(passes);
+				image(c, height - r - 1) = Color(sqrtf(avg.x), sqrtf(avg.y), sqrtf(avg.z));
+			}
+		}
+		return passes;
+	}
 
-		Color avg(0);
-		for (int s = 0; s < samplesPerPixel; s++) {
-			const float u = float(c + randFloat()) / float(width);
-			const float v = float(r + randFloat()) / float(height);
-			const Ray &ray = camera.getRay(u, v);
-			const vec3 sample = raytrace(ray, primitives);
-			avg += sample;
+	/// Copy the current image and hand it to a background task for encoding, so the workers can continue
+	/// with the next pass, tiles ahead of @pass are copied with the extra passes they already have
+	/// @return the writer task, it runs on the blocking pool
+	TaskSystem::TaskID scheduleSnapshot(int pass) {
+		std::unique_ptr<Snapshot> snapshot(new Snapshot);
+		snapshot->sink = sink;
+		snapshot->pass = pass;
+		snapshot->width = width;
+		snapshot->height = height;
+		snapshot->image.init(width, height);
+		for (int tile = 0; tile < tileCount(); tile++) {
+			const TileRect rect = tileRect(tile);
+			std::lock_guard<std::mutex> lock(tileLocks[tile]);
+			for (int r = rect.startY; r < rect.endY; r++) {
+				for (int c = rect.startX; c < rect.endX; c++) {
+					snapshot->image(c, height - r - 1) = image(c, height - r - 1);
+				}
+			}
 		}
 
-		avg /= samplesPerPixel;
-		image(c, height - r - 1) = Color(sqrtf(avg.x), sqrtf(avg.y), sqrtf(avg.z));
+		return TaskSystem::TaskSystemExecutor::GetInstance().ScheduleTask(library.snapshotWriter, std::make_unique<SnapshotTask>(std::move(snapshot)), snapshotPriority);
+	}
 
-		idx += threadCount;
+	/// Render one tile of one pass, the last tile to reach a pass count schedules a snapshot or writes the final image
+	/// @param item - pass * tileCount() + tile, items are claimed in order so passes are started in order
+	void renderItem(int item) {
+		const int tiles = tileCount();
+		const int tile = item % tiles;
+
+		// the previous pass of the tile could still be traced on another thread, this one does not wait for it
+		// and counts towards the passes the tile has once it is added, so snapshots only see complete passes
+		const int pass = renderTile(tile) - 1;
+		if (passTiles[pass].fetch_add(1, std::memory_order_acq_rel) != tiles - 1) {
+			return;
+		}
 
-		if (idx >= width * height) {
-			if (completedThreads.fetch_add(1) == threadCount - 1) {
-				const std::string resultImage = name + ".png";
-				const PNGImage &png = image.createPNGData();
-				const int success = stbi_write_png(resultImage.c_str(), width, height, PNGImage::componentCount(), png.data.data(), sizeof(PNGImage::Pixel) * width);
-				assert(success == 1);
-				return true;
-			}
+		const TaskSystem::TaskID writer = scheduleSnapshot(pass + 1);
+		if (pass == samplesPerPixel - 1) {
+			// the final image is part of the task result, the executor stops once it is written
+			onFinalImage(writer);
 		}
-		return false;
+	}
+
+	/// Claim and render the next chunk of tiles, tiles are handed out dynamically so expensive regions of the scene
+	/// do not leave the other threads waiting, and the next pass starts without waiting for the slowest tile
+	/// @return true if there are no more tiles to claim
+	bool renderStep(int threadIndex, int threadCount) {
+		return items->runChunk(threadIndex, [this](int64_t item) {
+			renderItem(int(item));
+		}) == 0;
 	}
 };
 
+/// Approximate memory of a loaded mesh with its accelerator, estimated from the size of the source file
+size_t meshBytes(const char *path) {
+	std::error_code error;
+	const uintmax_t fileSize = std::filesystem::file_size(path, error);
+	return error ? 0 : size_t(fileSize) * 2;
+}
+
+const size_t instanceBytes = 128; ///< Approximate memory of one instance in an Instancer
+
 void sceneExample(Scene &scene) {
 	scene.name = "example";
 	scene.initImage(800, 600, 4);
 	scene.camera.lookAt(90.f, {-0.1f, 5, -0.1f}, {0, 0, 0});
+}
 
+size_t geometryExample(Instancer &primitives) {
 	SharedPrimPtr mesh(new TriangleMesh(MESH_FOLDER "/cube.obj", MaterialPtr(new Lambert{Color(1, 0, 0)})));
 	Instancer *instancer = new Instancer;
 	instancer->addInstance(mesh, vec3(2, 0, 0));
 	instancer->addInstance(mesh, vec3(0, 0, 2));
 	instancer->addInstance(mesh, vec3(2, 0, 2));
-	scene.addPrimitive(PrimPtr(instancer));
+	primitives.addInstance(PrimPtr(instancer));
 
 	const float r = 0.6f;
-	scene.addPrimitive(PrimPtr(new SpherePrim{vec3(2, 0, 0), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)})}));
-	scene.addPrimitive(PrimPtr(new SpherePrim{vec3(0, 0, 2), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)})}));
-	scene.addPrimitive(PrimPtr(new SpherePrim{vec3(0, 0, 0), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)})}));
+	primitives.addInstance(PrimPtr(new SpherePrim{vec3(2, 0, 0), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)})}));
+	primitives.addInstance(PrimPtr(new SpherePrim{vec3(0, 0, 2), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)})}));
+	primitives.addInstance(PrimPtr(new SpherePrim{vec3(0, 0, 0), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)})}));
+	return meshBytes(MESH_FOLDER "/cube.obj") + 7 * instanceBytes;
 }
 
+const int manyHeavyMeshesCount = 50;
+
 void sceneManyHeavyMeshes(Scene &scene) {
 	scene.name = "instanced-dragons";
-	const int count = 50;
+	const int count = manyHeavyMeshesCount;
 
 	scene.initImage(1280, 720, 10);
 	scene.camera.lookAt(90.f, {0, 3, -count}, {0, 3, count});
+}
+
+size_t geometryManyHeavyMeshes(Instancer &primitives) {
+	const int count = manyHeavyMeshesCount;
 
 	SharedMaterialPtr instanceMaterials[] = {
 		SharedMaterialPtr(new Lambert{Color(0.2, 0.7, 0.1)}),
@@ -199,15 +427,22 @@ void sceneManyHeavyMeshes(Scene &scene) {
 		}
 	}
 
-	scene.addPrimitive(PrimPtr(instancer));
+	primitives.addInstance(PrimPtr(instancer));
+	return meshBytes(MESH_FOLDER "/dragon.obj") + size_t(2 * (2 * count + 1) * (2 * count + 1) + 2) * instanceBytes;
 }
 
+const int manySimpleMeshesCount = 20;
+
 void sceneManySimpleMeshes(Scene &scene) {
 	scene.name = "instanced-cubes";
-	const int count = 20;
+	const int count = manySimpleMeshesCount;
 
 	scene.initImage(800, 600, 2);
 	scene.camera.lookAt(90.f, {0, 2, count}, {0, 0, 0});
+}
+
+size_t geometryManySimpleMeshes(Instancer &primitives) {
+	const int count = manySimpleMeshesCount;
 
 	SharedPrimPtr mesh(new TriangleMesh(MESH_FOLDER "/cube.obj", MaterialPtr(new Lambert{Color(1, 0, 0)})));
 	Instancer *instancer = new Instancer;
@@ -218,49 +453,239 @@ void sceneManySimpleMeshes(Scene &scene) {
 		}
 	}
 
-	scene.addPrimitive(PrimPtr(instancer));
+	primitives.addInstance(PrimPtr(instancer));
+	return meshBytes(MESH_FOLDER "/cube.obj") + size_t((2 * count + 1) * (2 * count + 1) + 1) * instanceBytes;
 }
 
 void sceneHeavyMesh(Scene &scene) {
 	scene.name = "dragon";
 	scene.initImage(800, 600, 4);
 	scene.camera.lookAt(90.f, {8, 10, 7}, {0, 0, 0});
-	scene.addPrimitive(PrimPtr(new TriangleMesh(MESH_FOLDER "/dragon.obj", MaterialPtr(new Lambert{Color(0.2, 0.7, 0.1)}))));
 }
 
+size_t geometryHeavyMesh(Instancer &primitives) {
+	primitives.addInstance(PrimPtr(new TriangleMesh(MESH_FOLDER "/dragon.obj", MaterialPtr(new Lambert{Color(0.2, 0.7, 0.1)}))));
+	return meshBytes(MESH_FOLDER "/dragon.obj") + instanceBytes;
+}
+
+/// Sets up the image and camera of the scene, called for every task
 typedef void (*SceneCreator)(Scene &);
 
+/// Adds all primitives of the scene, called once per process while the result is cached
+/// @return approximate memory used by the primitives
+typedef size_t (*GeometryCreator)(Instancer &);
+
+struct SceneDescription {
+	SceneCreator scene;
+	GeometryCreator geometry;
+	std::vector<std::string> meshes; ///< Source files of the geometry, part of the cache key
+};
+
+/// Geometry requested by a render task, built on the pool by the "raytracer-geometry" executor
+struct GeometryBuild {
+	std::string cacheKey;
+	GeometryCreator geometry = nullptr;
+	std::shared_ptr<Instancer> primitives; ///< Set by the build task before it finishes
+};
+
+/// Task for the "raytracer-geometry" executor, the build is passed as the "build" param
+struct GeometryTask : TaskSystem::Task {
+	explicit GeometryTask(std::shared_ptr<GeometryBuild> build) : build(std::move(build)) {}
+
+	virtual std::optional<void*> GetAnyParam(const std::string &name) const {
+		if (name == "build") {
+			return build.get();
+		}
+		return std::nullopt;
+	}
+
+	virtual std::string GetExecutorName() const { return "raytracer-geometry"; }
+
+	std::shared_ptr<GeometryBuild> build;
+};
+
+/// Loads the meshes and builds the accelerators of a scene through the geometry cache, in a single step
+/// Builds of different scenes run in parallel, a task scheduled after the running build of its scene, see
+/// GeometryCache::scheduleBuild, only picks up the cached result
+struct GeometryBuilder : TaskSystem::Executor {
+	GeometryBuilder(std::unique_ptr<TaskSystem::Task> taskToExecute) : Executor(std::move(taskToExecute)) {
+		build = static_cast<GeometryBuild *>(task->GetParams().Get(library.build).value());
+		maxThreads = 1;
+	}
+
+	virtual ExecStatus ExecuteStep(int, int) {
+		const GeometryCreator geometry = build->geometry;
+		build->primitives = GeometryCache::GetInstance().acquire(build->cacheKey, [geometry](size_t &bytes) {
+			std::shared_ptr<Instancer> primitives(new Instancer);
+			bytes = geometry(*primitives);
+			primitives->onBeforeRender();
+			return primitives;
+		});
+		return ExecStatus::ES_Stop;
+	}
+
+	GeometryBuild *build = nullptr;
+};
+
 struct Renderer : TaskSystem::Executor {
 	Renderer(std::unique_ptr<TaskSystem::Task> taskToExecute) : Executor(std::move(taskToExecute)) {
-		std::string sceneName = task->GetStringParam("sceneName").value();
-		std::map<std::string, SceneCreator> sceneCreators = {
-			{ "Example", sceneExample},
-			{ "HeavyMesh", sceneHeavyMesh},
-			{ "ManySimpleMeshes", sceneManySimpleMeshes},
-			{ "ManyHeavyMeshes", sceneManyHeavyMeshes},
+		const TaskSystem::ParamBlock &params = task->GetParams();
+		const std::string sceneName = *params.Get(library.sceneName);
+		std::map<std::string, SceneDescription> sceneDescriptions = {
+			{ "Example", {sceneExample, geometryExample, {MESH_FOLDER "/cube.obj"}}},
+			{ "HeavyMesh", {sceneHeavyMesh, geometryHeavyMesh, {MESH_FOLDER "/dragon.obj"}}},
+			{ "ManySimpleMeshes", {sceneManySimpleMeshes, geometryManySimpleMeshes, {MESH_FOLDER "/cube.obj"}}},
+			{ "ManyHeavyMeshes", {sceneManyHeavyMeshes, geometryManyHeavyMeshes, {MESH_FOLDER "/dragon.obj"}}},
 		};
 
-		sceneCreators[sceneName](scene);
-		scene.onBeforeRender();
-		printf("Initialized scene [%s]\n", scene.name.c_str());
+		const SceneDescription &description = sceneDescriptions[sceneName];
+		description.scene(scene);
+		if (const std::optional<void *> samplesOut = params.Get(library.samplesOut)) {
+			// known up front, the caller reads it once the task is finished
+			*static_cast<int64_t *>(*samplesOut) = int64_t(scene.width) * scene.height * scene.samplesPerPixel;
+		}
+		scene.tileSize = params.Get(library.tileSize).value_or(scene.tileSize);
+		assert(scene.tileSize > 0);
+		scene.onFinalImage = [this](TaskSystem::TaskID writer) {
+			// counted before the flag is set, a step that sees the flag waits for the resume call to return
+			int current = waking.load();
+			do {
+				if (current < 0) {
+					// cancelled, the image is still written but nothing waits for it
+					return;
+				}
+			} while (!waking.compare_exchange_weak(current, current + 1));
+			finalImageRequested.store(true);
+			TaskSystem::TaskSystemExecutor::GetInstance().OnTaskCompleted(writer, [this](TaskSystem::TaskID) {
+				finalImageWritten.store(true);
+				TaskSystem::ThreadManager::GetInstance().resume(*this);
+				waking.fetch_sub(1);
+			});
+		};
+		scene.initPasses(task->GetPriority(), TaskSystem::ThreadManager::GetInstance().getThreadCount());
+
+		// tasks rendering the same scene share the loaded meshes and built accelerators
+		GeometryCache &cache = GeometryCache::GetInstance();
+		// edited mesh files get a new key, the stale geometry is no longer used and gets evicted
+		std::string cacheKey = "scene:" + sceneName;
+		for (const std::string &mesh : description.meshes) {
+			cacheKey += "|" + GeometryCache::fileFingerprint(mesh);
+		}
+		scene.primitives = cache.lookup<Instancer>(cacheKey);
+		if (scene.primitives) {
+			geometryReady.store(true);
+			printf("Initialized scene [%s]\n", scene.name.c_str());
+			return;
+		}
+
+		// the build runs as its own task on the pool, the render slots are suspended until it is finished
+		// renders of a scene that is already being built run their task after that build, so it is built once
+		std::shared_ptr<GeometryBuild> build(new GeometryBuild{cacheKey, description.geometry});
+		TaskSystem::TaskSystemExecutor &ts = TaskSystem::TaskSystemExecutor::GetInstance();
+		const int priority = task->GetPriority();
+		const TaskSystem::TaskID buildTask = cache.scheduleBuild(cacheKey, [&ts, &build, priority](std::span<const TaskSystem::TaskID> running) {
+			return ts.ScheduleTask(library.geometryBuilder, std::make_unique<GeometryTask>(build), priority, running);
+		});
+		waking.fetch_add(1);
+		ts.OnTaskCompleted(buildTask, [this, build](TaskSystem::TaskID) {
+			scene.primitives = build->primitives;
+			geometryReady.store(true);
+			printf("Initialized scene [%s]\n", scene.name.c_str());
+			// no-op if this is still called from the constructor, steps will find the geometry ready
+			TaskSystem::ThreadManager::GetInstance().resume(*this);
+			waking.fetch_sub(1);
+		});
 	}
 
 	virtual ~Renderer() {}
 
 	virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) {
-		return scene.renderStep(threadIndex, threadCount) ? ExecStatus::ES_Stop : ExecStatus::ES_Continue;
+		if (!geometryReady.load()) {
+			return ExecStatus::ES_Suspend;
+		}
+		if (IsCancelled()) {
+			// no more tiles are claimed, the slots only wait for the callbacks still holding the renderer
+			if (finalImageRequested.load() && !finalImageWritten.load()) {
+				return ExecStatus::ES_Suspend;
+			}
+			return TryCancel() ? ExecStatus::ES_Stop : ExecStatus::ES_Continue;
+		}
+		if (!scene.renderStep(threadIndex, threadCount)) {
+			return ExecStatus::ES_Continue;
+		}
+		// all tiles are claimed, the slots wait without a worker until the blocking pool wrote the final image
+		if (!finalImageWritten.load()) {
+			return ExecStatus::ES_Suspend;
+		}
+		return waking.load() == 0 ? ExecStatus::ES_Stop : ExecStatus::ES_Continue;
 	};
 
+	/// Declines while the geometry build or the final image write can still resume the renderer
+	virtual bool TryCancel() {
+		int expected = 0;
+		return waking.compare_exchange_strong(expected, dropped) || expected < 0;
+	}
+
+	std::atomic<bool> geometryReady = false; ///< Set once @scene.primitives is built
+	std::atomic<bool> finalImageRequested = false; ///< The last pass is done, its writer task resumes the renderer
+	std::atomic<bool> finalImageWritten = false;
+	/// Callbacks that resume the renderer and have not returned yet, the executor can't stop before they do
+	/// Set to @dropped by TryCancel, no callback is registered after that
+	std::atomic<int> waking = 0;
+	static constexpr int dropped = INT_MIN / 2;
 	std::atomic<int> current = 0;
 	int max = 0;
 	int sleepMs = 0;
 	Scene scene;
 };
 
+/// Encodes and writes one snapshot on the blocking pool in a single step
+struct SnapshotWriter : TaskSystem::Executor {
+	SnapshotWriter(std::unique_ptr<TaskSystem::Task> taskToExecute) : Executor(std::move(taskToExecute)) {
+		snapshot = static_cast<Snapshot *>(task->GetParams().Get(library.snapshot).value());
+		maxThreads = 1;
+	}
+
+	virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) {
+		if (!claimed.exchange(true)) {
+			snapshot->sink->write(snapshot->pass, snapshot->image, snapshot->width, snapshot->height);
+		}
+		return ExecStatus::ES_Stop;
+	}
+
+	std::atomic<bool> claimed = false;
+	Snapshot *snapshot = nullptr;
+};
+
 TaskSystem::Executor* ExecutorConstructorImpl(std::unique_ptr<TaskSystem::Task> taskToExecute) {
 	return new Renderer(std::move(taskToExecute));
 }
 
+TaskSystem::Executor* SnapshotConstructorImpl(std::unique_ptr<TaskSystem::Task> taskToExecute) {
+	return new SnapshotWriter(std::move(taskToExecute));
+}
+
+TaskSystem::Executor* GeometryConstructorImpl(std::unique_ptr<TaskSystem::Task> taskToExecute) {
+	return new GeometryBuilder(std::move(taskToExecute));
+}
+
 IMPLEMENT_ON_INIT() {
-	ts.Register("raytracer", &ExecutorConstructorImpl);
+	// shared by all render tasks, so it is set once for the library and not by each task
+	GeometryCache::GetInstance().setBudget(size_t(GEOMETRY_CACHE_MB) << 20);
+
+	TaskSystem::ParamSchema renderSchema;
+	library.sceneName = renderSchema.Add<std::string>("sceneName", true);
+	library.tileSize = renderSchema.Add<int>("tileSize");
+	// int64_t receiving the number of samples the task traces, for measuring throughput
+	library.samplesOut = renderSchema.Add<void *>("samplesOut");
+	ts.Register("raytracer", &ExecutorConstructorImpl, std::move(renderSchema));
+
+	TaskSystem::ParamSchema snapshotSchema;
+	library.snapshot = snapshotSchema.Add<void *>("snapshot", true);
+	// PNG encoding and the file write block, they run on the blocking pool and leave the workers to rendering
+	library.snapshotWriter = ts.Register("raytracer-snapshot", &SnapshotConstructorImpl, std::move(snapshotSchema), TaskSystem::EC_Blocking);
+
+	TaskSystem::ParamSchema geometrySchema;
+	library.build = geometrySchema.Add<void *>("build", true);
+	library.geometryBuilder = ts.Register("raytracer-geometry", &GeometryConstructorImpl, std::move(geometrySchema));
 }
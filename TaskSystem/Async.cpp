@@ -0,0 +1,96 @@
+#include "Async.h"
+
+#include <fstream>
+#include <iterator>
+
+namespace TaskSystem {
+
+Executor::ExecStatus AsyncExecutor::ExecuteStep(int, int) {
+    if (!body.handle) {
+        body = Run();
+        body.handle.promise().executor = this;
+    }
+
+    if (IsCancelled()) {
+        // the body is destroyed with the executor, where it is suspended, once the event it waits for woke it
+        if (TryCancel()) {
+            return ES_Stop;
+        }
+        return ready.load() ? ES_Continue : ES_Suspend;
+    }
+
+    if (!body.handle.done()) {
+        if (!ready.exchange(false)) {
+            // stepped again before the awaited event happened, the wake resumes the slot
+            return ES_Suspend;
+        }
+        body.handle.resume();
+    }
+
+    if (body.handle.done()) {
+        // a wake that let the body finish can still be inside ThreadManager::resume, it touches this executor
+        return waking.load() == 0 ? ES_Stop : ES_Continue;
+    }
+    return ready.load() ? ES_Continue : ES_Suspend;
+}
+
+bool AsyncExecutor::TryCancel() {
+    int expected = 0;
+    return waking.compare_exchange_strong(expected, dropped) || expected < 0;
+}
+
+void AsyncExecutor::suspend(const std::function<void(AsyncWake)> &start) {
+    if (waking.fetch_add(1) < 0) {
+        // cancelled during this step, the event is not started and the executor is dropped once the step returns
+        return;
+    }
+    start([this]() {
+        wake();
+    });
+}
+
+void AsyncExecutor::wake() {
+    ready.store(true);
+    ThreadManager::GetInstance().resume(*this);
+    waking.fetch_sub(1);
+}
+
+SuspendAwaiter AsyncBody::promise_type::await_transform(TaskID task) {
+    return SuspendAwaiter{[task](AsyncWake wake) {
+        // called right away if the task is already finished
+        TaskSystemExecutor::GetInstance().OnTaskCompleted(task, [wake = std::move(wake)](TaskID) {
+            wake();
+        });
+    }};
+}
+
+std::optional<std::string> ReadFileAwaiter::read(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return std::nullopt;
+    }
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+/// Single blocking call, stepped once on the blocking pool
+struct BlockingJob : Executor {
+    explicit BlockingJob(std::function<void()> job) : Executor(nullptr), job(std::move(job)) {
+        maxThreads = 1;
+    }
+
+    ExecStatus ExecuteStep(int, int) override {
+        job();
+        return ES_Stop;
+    }
+
+    std::function<void()> job;
+};
+
+void RunBlocking(std::function<void()> job) {
+    BlockingJob *executor = new BlockingJob(std::move(job));
+    ThreadManager::GetBlockingInstance().runThreadsNoWait(*executor, 0, 1, [executor]() {
+        delete executor;
+    });
+}
+
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "Executor.h"
+#include "TaskSystem.h"
+
+#include <atomic>
+#include <climits>
+#include <string>
+#include <memory>
+#include <utility>
+#include <optional>
+#include <coroutine>
+#include <exception>
+#include <functional>
+
+namespace TaskSystem {
+
+class AsyncExecutor;
+
+/// Wakes a suspended AsyncExecutor body up, can be called from any thread, must be called exactly once
+typedef std::function<void()> AsyncWake;
+
+/// Suspend the body until @start calls the wake it is given, see Suspend
+struct SuspendAwaiter {
+	std::function<void(AsyncWake)> start;
+
+	bool await_ready() const noexcept { return false; }
+	template <typename Promise>
+	void await_suspend(std::coroutine_handle<Promise> handle);
+	void await_resume() const noexcept {}
+};
+
+/// Give the worker back to the scheduler and continue on the next step, see YieldPoint
+struct YieldAwaiter {
+	bool await_ready() const noexcept { return false; }
+	template <typename Promise>
+	void await_suspend(std::coroutine_handle<Promise> handle);
+	void await_resume() const noexcept {}
+};
+
+/// Read a whole file on the blocking pool, see ReadFile
+struct ReadFileAwaiter {
+	std::string path;
+	std::optional<std::string> contents;
+
+	bool await_ready() const noexcept { return false; }
+	template <typename Promise>
+	void await_suspend(std::coroutine_handle<Promise> handle);
+	std::optional<std::string> await_resume() { return std::move(contents); }
+
+	/// Blocking read, run on the blocking pool
+	static std::optional<std::string> read(const std::string &path);
+};
+
+/// Coroutine type of AsyncExecutor::Run, the body starts suspended and each step of the executor resumes it
+/// Besides the awaiters above, a TaskID can be awaited directly to continue once that task is finished
+class AsyncBody {
+public:
+	struct promise_type {
+		AsyncExecutor *executor = nullptr; ///< Set by the executor right after creating the body
+
+		AsyncBody get_return_object() { return AsyncBody(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+
+		SuspendAwaiter await_transform(TaskID task);
+		template <typename Awaiter>
+		Awaiter await_transform(Awaiter awaiter) { return awaiter; }
+	};
+	typedef std::coroutine_handle<promise_type> Handle;
+
+	AsyncBody() = default;
+	AsyncBody(AsyncBody &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	AsyncBody &operator=(AsyncBody &&other) noexcept {
+		std::swap(handle, other.handle);
+		return *this;
+	}
+	AsyncBody(const AsyncBody &) = delete;
+	AsyncBody &operator=(const AsyncBody &) = delete;
+	~AsyncBody() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+private:
+	friend class AsyncExecutor;
+	explicit AsyncBody(Handle handle) : handle(handle) {}
+
+	Handle handle;
+};
+
+/// Executor whose work is written as a coroutine instead of a state machine around ExecuteStep
+/// The body runs on a single thread index, each step resumes it on whichever worker picked the executor up.
+/// While the body waits for a task, a file or any other event the executor is suspended (ES_Suspend) and
+/// holds no worker, the event resumes it through ThreadManager::resume. A cancelled executor is dropped between
+/// steps with the body destroyed where it is suspended, once no event it waits for can wake it anymore.
+/// Derived classes implement Run:
+///
+///     AsyncBody Run() override {
+///         std::optional<std::string> scene = co_await ReadFile(path);
+///         co_await TaskSystemExecutor::GetInstance().ScheduleTask(parse(*scene), task->GetPriority());
+///         co_await YieldPoint();
+///         ...
+///     }
+class AsyncExecutor : public Executor {
+public:
+	explicit AsyncExecutor(std::unique_ptr<Task> taskToExecute) : Executor(std::move(taskToExecute)) {
+		// the body is sequential, other workers would only find nothing to do
+		maxThreads = 1;
+	}
+
+	ExecStatus ExecuteStep(int threadIndex, int threadCount) override;
+
+	/// Declines while the body waits for an event, the wake would resume a destroyed executor
+	bool TryCancel() override;
+
+protected:
+	/// The body of the executor, called on the first step
+	virtual AsyncBody Run() = 0;
+
+private:
+	friend struct SuspendAwaiter;
+	friend struct YieldAwaiter;
+
+	/// Called from await_suspend, the body is suspended already and the step that resumed it is still running
+	void suspend(const std::function<void(AsyncWake)> &start);
+	void wake();
+
+	AsyncBody body;
+	std::atomic<bool> ready = true; ///< The body can be resumed, cleared by each step before resuming it
+	/// Events the body waits for and wakes still inside ThreadManager::resume, the executor can't stop before they
+	/// return. Set to @dropped by TryCancel, no new event is started after that
+	std::atomic<int> waking = 0;
+	static constexpr int dropped = INT_MIN / 2;
+};
+
+/// Suspend the body until @start calls the wake it is given, @start is called right away on the same thread
+/// and may call the wake before returning. Building block for awaiting any callback based event
+inline SuspendAwaiter Suspend(std::function<void(AsyncWake)> start) {
+	return SuspendAwaiter{std::move(start)};
+}
+
+/// Let the worker check priorities and shares, the body continues on the next step, possibly on another worker
+inline YieldAwaiter YieldPoint() {
+	return YieldAwaiter{};
+}
+
+/// Read the whole file at @path without blocking a worker, empty if it can't be read
+inline ReadFileAwaiter ReadFile(std::string path) {
+	return ReadFileAwaiter{std::move(path), std::nullopt};
+}
+
+/// Run @job once on the blocking pool, for calls that would otherwise block a compute worker
+void RunBlocking(std::function<void()> job);
+
+template <typename Promise>
+void SuspendAwaiter::await_suspend(std::coroutine_handle<Promise> handle) {
+	handle.promise().executor->suspend(start);
+}
+
+template <typename Promise>
+void YieldAwaiter::await_suspend(std::coroutine_handle<Promise> handle) {
+	handle.promise().executor->ready.store(true);
+}
+
+template <typename Promise>
+void ReadFileAwaiter::await_suspend(std::coroutine_handle<Promise> handle) {
+	// the awaiter lives in the coroutine frame, which stays put until the wake resumes it
+	SuspendAwaiter{[this](AsyncWake wake) {
+		RunBlocking([this, wake = std::move(wake)]() {
+			contents = read(path);
+			wake();
+		});
+	}}.await_suspend(handle);
+}
+
+};
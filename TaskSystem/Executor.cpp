@@ -1,22 +1,114 @@
 #include "Executor.h"
-#include <queue>
+#include <map>
+#include <set>
 #include <mutex>
+#include <atomic>
 #include <thread>
 #include <vector>
+#include <chrono>
+#include <cstdio>
 #include <cassert>
+#include <algorithm>
 #include <functional>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
 
 namespace TaskSystem {
 
+/// Hint the CPU that this is a spin loop, lets the SMT sibling run and avoids a pipeline flush on exit
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+static int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// One threadIndex of a scheduled executor, owned by at most one worker or deque at a time
+struct ExecutorSlot {
+    ScheduledExecutor *owner = nullptr;
+    int index = -1;
+};
+
+/// Book-keeping for an executor while it is owned by the ThreadManager
+struct ScheduledExecutor {
+    Executor *executor = nullptr;
+    int priority = 0;
+    int weight = 1; ///< Share of the threads relative to other executors with the same priority
+    uint64_t order = 0; ///< Submission order, keeps FIFO between equal priorities
+    int64_t submitTime = 0; ///< nowNs when scheduled, for the dispatch latency
+    int64_t deadline = INT64_MAX; ///< Executor::deadline in nowNs time, INT64_MAX if there is none
+    int64_t key = 0; ///< Orders the executors with the same priority in the queue, see SchedulingPolicy
+    std::unique_ptr<ExecutorSlot[]> slots; ///< One slot for each thread index
+    int slotCount = 0; ///< Number of @slots, the thread count passed to ExecuteStep
+    ThreadManager *manager = nullptr; ///< The instance the executor was scheduled on
+
+    int nextSlot = 0; ///< The next slot no worker is attached to yet, protected by the queue mutex
+    std::vector<ExecutorSlot *> resumed; ///< Resumed slots, handed out before @nextSlot, protected by the queue mutex
+    bool queued = false; ///< Set while in the queue, protected by the queue mutex
+
+    /// One reference for being in the queue and one for each slot handed out to workers
+    std::atomic<int> refs = 1;
+    std::atomic<bool> stopped = false; ///< Set once ExecuteStep returned ES_Stop on any thread
+    std::atomic<int> active = 0; ///< Number of workers stepping one of the slots right now
+    std::atomic<int> *levelWeight = nullptr; ///< Total weight of the priority, set once the executor is moved to the queue
+    std::function<void()> onFinished; ///< Called on the worker that retires the executor
+
+    std::mutex suspendMtx; ///< Protects @suspended
+    std::vector<ExecutorSlot *> suspended; ///< Slots that returned ES_Suspend, each keeps its reference
+    std::atomic<uint64_t> resumes = 0; ///< Number of resume calls, a step overlapping one does not suspend
+};
+
+bool ThreadManager::QueueOrder::operator()(const ScheduledExecutor *a, const ScheduledExecutor *b) const {
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+    if (a->key != b->key) {
+        return a->key < b->key;
+    }
+    return a->order < b->order;
+}
+
 ThreadManager* ThreadManager::self = nullptr;
+ThreadManager* ThreadManager::blockingSelf = nullptr;
+
+/// Set on the worker threads, waits from inside ExecuteStep help with the work instead of blocking the worker
+static thread_local const ThreadManager *currentManager = nullptr;
+static thread_local int currentThreadIndex = -1;
+
+/// Taken by ThreadManager::cancel to look up the book-keeping of an executor and by the release that frees it,
+/// shared by all instances since cancel can be called on any of them
+static std::mutex retireMtx;
 
 ThreadManager &ThreadManager::GetInstance() {
     return *self;
 }
 
-void ThreadManager::Init(int threadCount) {
+ThreadManager &ThreadManager::GetBlockingInstance() {
+    return *blockingSelf;
+}
+
+void ThreadManager::Init(int threadCount, int blockingThreads) {
+    Init(ThreadPlacement::Unpinned(threadCount), blockingThreads);
+}
+
+void ThreadManager::Init(const ThreadPlacement &placement, int blockingThreads) {
+    assert(blockingThreads > 0 && "Blocking pool needs at least one thread");
     delete self;
-    self = new ThreadManager(threadCount);
+    delete blockingSelf;
+    self = new ThreadManager(placement.Resolve(Topology::GetSystem()));
+    blockingSelf = new ThreadManager(std::vector<ThreadPlacement::Worker>(blockingThreads), true);
+}
+
+ThreadManager::~ThreadManager() {
+    if (running) {
+        stop();
+    }
 }
 
 void ThreadManager::start() {
@@ -24,106 +116,779 @@ void ThreadManager::start() {
     assert(threads.size() == 0 && "Already started");
 
     running = true;
-    currentTask.resize(count, nullptr);
+    workers.reset(new Worker[count]);
 
+    for (int c = 0; c < count; c++) {
+        workers[c].rng = 0x9E3779B97F4A7C15ull * (c + 1);
+        for (int victim = 0; victim < count; victim++) {
+            if (victim != c && placement[victim].node == placement[c].node) {
+                workers[c].victims.push_back(victim);
+            }
+        }
+        workers[c].localVictims = int(workers[c].victims.size());
+        for (int victim = 0; victim < count; victim++) {
+            if (placement[victim].node != placement[c].node) {
+                workers[c].victims.push_back(victim);
+            }
+        }
+    }
+
+    if (elastic) {
+        // started by grow once there is work
+        return;
+    }
     threads.reserve(count);
     for (int c = 0; c < count; c++) {
         threads.emplace_back(&ThreadManager::threadBase, this, c);
     }
-    // does not block to wait for threads to start, if they are delayed @runThreads will make sure to wait for them
+    // only waits for the placement, so getUnpinnedCount is known, the threads then look for work on their own
+    for (int placed = placedCount.load(); placed < count; placed = placedCount.load()) {
+        placedCount.wait(placed);
+    }
 }
 
-void ThreadManager::runThreadsNoWait(TaskSystem::Executor &task) {
-    {
-        std::lock_guard<std::mutex> lock(workMtx);
-        assert(unlockedAllTasksDone() && "Already working");
-        for (int c = 0; c < int(currentTask.size()); c++) {
-            currentTask[c] = &task;
+void ThreadManager::runThreadsNoWait(TaskSystem::Executor &task, int priority, int weight, std::function<void()> onFinished) {
+    assert(weight > 0 && "Weight must be positive");
+    ScheduledExecutor *scheduled = new ScheduledExecutor;
+    scheduled->executor = &task;
+    scheduled->priority = priority;
+    scheduled->weight = weight;
+    scheduled->onFinished = std::move(onFinished);
+    assert(task.maxThreads > 0 && "Executor must allow at least one thread");
+    scheduled->slotCount = std::min(count, task.maxThreads);
+    scheduled->manager = this;
+    scheduled->slots.reset(new ExecutorSlot[scheduled->slotCount]);
+    for (int c = 0; c < scheduled->slotCount; c++) {
+        scheduled->slots[c].owner = scheduled;
+        scheduled->slots[c].index = c;
+    }
+
+    assert(running && "Must be started before scheduling");
+    scheduled->order = submitted.fetch_add(1, std::memory_order_relaxed);
+    scheduled->submitTime = nowNs();
+    if (task.deadline != std::chrono::steady_clock::time_point::max()) {
+        scheduled->deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(task.deadline.time_since_epoch()).count();
+    }
+    // fixed for the lifetime of the executor, the order of @queue must not change under it
+    const bool byDeadline = schedulingPolicy.load(std::memory_order_relaxed) == SP_EarliestDeadline;
+    const int64_t key = byDeadline ? scheduled->deadline : 0;
+    scheduled->key = key;
+    // the executor can be retired as soon as it is pushed, nothing is read from @scheduled after that
+    const int slotCount = scheduled->slotCount;
+    task.scheduled.store(scheduled);
+    TS_TRACE(TE_TaskScheduled, task.traceId, task.traceName, priority);
+
+    if (submissions.tryPush(scheduled)) {
+        // pushed before raising the hint, a worker that stores older hints after draining checks the queue again
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int top = topPriority.load();
+        while (top < priority && !topPriority.compare_exchange_weak(top, priority)) {
+        }
+        if (byDeadline && topPriority.load() == priority) {
+            // workers on later deadlines with the same priority leave for it without waiting for a drain
+            int64_t topDeadline = topKey.load();
+            while (topDeadline > key && !topKey.compare_exchange_weak(topDeadline, key)) {
+            }
         }
+    } else {
+        std::lock_guard<std::mutex> lock(queueMtx);
+        unlockedInsert(scheduled);
+        unlockedUpdateDispatchHints();
     }
 
-    workEvent.notify_all();
+    wakeWorkers(slotCount);
 }
 
-void ThreadManager::runThreads(TaskSystem::Executor &task) {
-    runThreadsNoWait(task);
+void ThreadManager::runThreads(TaskSystem::Executor &task, int priority) {
+    std::atomic<bool> done = false;
+    const int threadIndex = getCurrentThreadIndex();
+
+    runThreadsNoWait(task, priority, 1, [this, &done, threadIndex]() {
+        done.store(true);
+        if (threadIndex >= 0) {
+            wakeWorker(threadIndex);
+        } else {
+            done.notify_one();
+        }
+    });
+
+    if (threadIndex >= 0) {
+        // nested in a step, blocking this worker could leave the executor without the thread it needs
+        helpUntil(threadIndex, [&done]() {
+            return done.load();
+        });
+        return;
+    }
+
+    // poll like an idle worker first, short executors finish before a kernel wait would even start
+    const int64_t spin = spinNs.load(std::memory_order_relaxed);
+    const int64_t budget = spin + yieldNs.load(std::memory_order_relaxed);
+    const int64_t start = nowNs();
+    for (int64_t elapsed = 0; !done.load() && elapsed < budget; elapsed = nowNs() - start) {
+        if (elapsed < spin) {
+            cpuRelax();
+        } else {
+            std::this_thread::yield();
+        }
+    }
 
     // block until task is complete
-    if (!unlockedAllTasksDone()) {
-        std::unique_lock<std::mutex> lock(workMtx);
-        if (!unlockedAllTasksDone()) {
-            workEvent.wait(lock, [this]() {
-                return unlockedAllTasksDone();
-            });
+    done.wait(false);
+}
+
+void ThreadManager::resume(TaskSystem::Executor &task) {
+    ScheduledExecutor *scheduled = task.scheduled.load();
+    if (!scheduled) {
+        return;
+    }
+    if (scheduled->manager != this) {
+        scheduled->manager->resume(task);
+        return;
+    }
+
+    scheduled->resumes.fetch_add(1);
+    std::vector<ExecutorSlot *> slots;
+    {
+        std::lock_guard<std::mutex> lock(scheduled->suspendMtx);
+        slots.swap(scheduled->suspended);
+    }
+    if (slots.empty()) {
+        return;
+    }
+
+    bool stopped = false;
+    {
+        std::lock_guard<std::mutex> lock(queueMtx);
+        stopped = scheduled->stopped.load();
+        if (!stopped) {
+            scheduled->resumed.insert(scheduled->resumed.end(), slots.begin(), slots.end());
+            if (!scheduled->queued) {
+                scheduled->refs.fetch_add(1, std::memory_order_relaxed);
+                scheduled->queued = true;
+                queue.insert(scheduled);
+            }
+            unlockedUpdateDispatchHints();
+        }
+    }
+
+    if (stopped) {
+        // stopExecutor already ran, the references of the taken slots are dropped here
+        for (int c = 0; c < int(slots.size()); c++) {
+            release(scheduled);
         }
+        return;
     }
+
+    wakeWorkers(int(slots.size()));
+}
+
+void ThreadManager::cancel(TaskSystem::Executor &task) {
+    task.cancelled.store(true);
+    ScheduledExecutor *scheduled = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(retireMtx);
+        scheduled = task.scheduled.load();
+        if (!scheduled) {
+            return;
+        }
+        // a reference keeps the book-keeping alive after the lock, none can be taken once the last one is dropped
+        int refs = scheduled->refs.load();
+        do {
+            if (refs == 0) {
+                return;
+            }
+        } while (!scheduled->refs.compare_exchange_weak(refs, refs + 1));
+    }
+
+    ThreadManager *manager = scheduled->manager;
+    if (task.TryCancel()) {
+        manager->stopExecutor(scheduled, Executor::SR_Cancelled);
+    }
+    // the executor is retired here if none of its slots is being stepped
+    manager->release(scheduled);
 }
 
 void ThreadManager::stop() {
     assert(running && "Can't stop if not running");
 
+    running = false;
+    for (int c = 0; c < count; c++) {
+        workers[c].state.store(WS_Awake);
+        workers[c].state.notify_one();
+    }
+
+    // @grow checks @running under the lock, no thread is started once the handles are taken
+    std::vector<std::thread> joining;
     {
-        std::lock_guard<std::mutex> lock(workMtx);
-        running = false;
+        std::lock_guard<std::mutex> lock(threadsMtx);
+        joining.swap(threads);
+    }
+    // joining threads will implicitly wait for all of them to finish current executor
+    for (int c = 0; c < int(joining.size()); c++) {
+        joining[c].join();
+    }
+
+    parkedCount = 0;
+}
+
+int ThreadManager::getThreadCount() const {
+    return count;
+}
+
+int ThreadManager::getWorkerNode(int threadIndex) const {
+    return placement[threadIndex].node;
+}
+
+int ThreadManager::getUnpinnedCount() const {
+    return unpinnedCount.load();
+}
+
+int ThreadManager::getCurrentThreadIndex() const {
+    return currentManager == this ? currentThreadIndex : -1;
+}
+
+void ThreadManager::helpUntil(int threadIndex, const std::function<bool()> &done) {
+    assert(threadIndex >= 0 && threadIndex == getCurrentThreadIndex() && "Only a worker can help on its own thread");
+    // the waiting step does not use the worker meanwhile, its executor should not hold a share of the threads
+    // this also keeps the number of active executors below the thread count, which bounds the queue scans
+    ExecutorSlot *waiting = workers[threadIndex].stepping;
+    if (waiting) {
+        waiting->owner->active.fetch_sub(1, std::memory_order_relaxed);
+    }
+    while (!done()) {
+        if (!running.load(std::memory_order_acquire)) {
+            // stopping, the awaited work is finished by the workers still stepping it
+            std::this_thread::yield();
+            continue;
+        }
+        if (ExecutorSlot *slot = tryFindWork(threadIndex)) {
+            stepSlot(threadIndex, slot, &done);
+        } else if (!pollForWork(threadIndex, &done)) {
+            park(threadIndex, &done);
+        }
+    }
+    if (waiting) {
+        waiting->owner->active.fetch_add(1, std::memory_order_relaxed);
     }
+}
+
+void ThreadManager::wakeWorker(int threadIndex) {
+    // pairs with the fence in park, either this sees the worker parked or the worker sees @done
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    tryWake(threadIndex, nowNs());
+}
+
+void ThreadManager::setIdlePolicy(const IdlePolicy &policy) {
+    spinNs.store(std::max<int64_t>(0, policy.spin.count()), std::memory_order_relaxed);
+    yieldNs.store(std::max<int64_t>(0, policy.yield.count()), std::memory_order_relaxed);
+    hotWorkers.store(std::clamp(policy.hotWorkers, 0, count), std::memory_order_relaxed);
+}
 
-    workEvent.notify_all();
+void ThreadManager::setSchedulingPolicy(SchedulingPolicy policy) {
+    schedulingPolicy.store(policy, std::memory_order_relaxed);
+}
 
-    // joining threads will implicitly wait for all of them to finish current task
-    for (int c = 0; c < int(threads.size()); c++) {
-        threads[c].join();
+IdleStats ThreadManager::getIdleStats() const {
+    IdleStats stats;
+    if (!workers) {
+        return stats;
     }
 
-    threads.clear();
-    currentTask.clear();
+    uint64_t wakeLatency[LatencyHistogram::bucketCount] = {};
+    uint64_t dispatchLatency[LatencyHistogram::bucketCount] = {};
+    for (int c = 0; c < count; c++) {
+        const Worker &worker = workers[c];
+        stats.spinHits += worker.spinHits.load(std::memory_order_relaxed);
+        stats.parks += worker.parks.load(std::memory_order_relaxed);
+        stats.wakes += worker.wakes.load(std::memory_order_relaxed);
+        worker.wakeLatency.mergeInto(wakeLatency);
+        worker.dispatchLatency.mergeInto(dispatchLatency);
+    }
+    stats.wakeP50Ns = LatencyHistogram::percentile(wakeLatency, 0.5);
+    stats.wakeP99Ns = LatencyHistogram::percentile(wakeLatency, 0.99);
+    stats.dispatchP50Ns = LatencyHistogram::percentile(dispatchLatency, 0.5);
+    stats.dispatchP99Ns = LatencyHistogram::percentile(dispatchLatency, 0.99);
+    return stats;
 }
 
-int ThreadManager::getThreadCount() const {
-    return int(threads.size());
+int ThreadManager::shareOf(const ScheduledExecutor *executor) const {
+    // read without the lock, a share that is off for a moment only delays rebalancing
+    const int totalWeight = std::max(executor->weight, executor->levelWeight->load(std::memory_order_relaxed));
+    return std::max(1, count * executor->weight / totalWeight);
 }
 
-void ThreadManager::threadBase(volatile int threadIndex) {
-    while (true) {
+ScheduledExecutor *ThreadManager::unlockedPickQueued() const {
+    if (queue.empty()) {
+        return nullptr;
+    }
 
-        TaskSystem::Executor *toExecute = nullptr;
-        if (running) {
-            std::unique_lock<std::mutex> lock(workMtx);
+    // among the executors with top priority pick the earliest deadline, or the one with fewest threads per unit of weight
+    ScheduledExecutor *best = *queue.begin();
+    if (schedulingPolicy.load(std::memory_order_relaxed) == SP_EarliestDeadline) {
+        return best;
+    }
+    for (ScheduledExecutor *executor : queue) {
+        if (executor->priority != best->priority) {
+            break;
+        }
+        if (int64_t(executor->active.load()) * best->weight < int64_t(best->active.load()) * executor->weight) {
+            best = executor;
+        }
+        if (best->active.load() == 0) {
+            // nothing is below an idle executor, no need to look at the rest
+            break;
+        }
+    }
+    return best;
+}
+
+void ThreadManager::unlockedInsert(ScheduledExecutor *executor) {
+    executor->queued = true;
+    queue.insert(executor);
+    // map nodes do not move, the pointer stays valid for the lifetime of the ThreadManager
+    executor->levelWeight = &levelWeights[executor->priority];
+    executor->levelWeight->fetch_add(executor->weight, std::memory_order_relaxed);
+}
+
+void ThreadManager::unlockedDrainSubmissions() {
+    while (ScheduledExecutor *executor = submissions.tryPop()) {
+        unlockedInsert(executor);
+    }
+}
+
+void ThreadManager::unlockedUpdateDispatchHints() {
+    ScheduledExecutor *late = nullptr;
+    do {
+        if (late) {
+            unlockedInsert(late);
+        }
+        unlockedDrainSubmissions();
 
-            if (running && currentTask[threadIndex] == nullptr) {
-                workEvent.wait(lock, [this, threadIndex]() {
-                    return currentTask[threadIndex] != nullptr || !running;
-                });
+        ScheduledExecutor *next = unlockedPickQueued();
+        topKey.store(next ? next->key : INT64_MAX, std::memory_order_relaxed);
+        topPriority.store(next ? next->priority : INT_MIN);
+
+        if (next && next->active.load() < shareOf(next) && schedulingPolicy.load(std::memory_order_relaxed) == SP_Weighted) {
+            balancePriority.store(next->priority, std::memory_order_relaxed);
+            balanceTarget.store(next, std::memory_order_relaxed);
+        } else {
+            balancePriority.store(INT_MIN, std::memory_order_relaxed);
+            balanceTarget.store(nullptr, std::memory_order_relaxed);
+        }
+        // a submission not visible here raises @topPriority itself, after the store above
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    } while ((late = submissions.tryPop()));
+    TS_TRACE(TE_QueueDepth, 0, nullptr, int(queue.size()));
+}
+
+ExecutorSlot *ThreadManager::takeQueued(int threadIndex) {
+    if (topPriority.load(std::memory_order_relaxed) == INT_MIN) {
+        return nullptr;
+    }
+
+    ExecutorSlot *slot = nullptr;
+    ScheduledExecutor *dequeued = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(queueMtx);
+        unlockedDrainSubmissions();
+        ScheduledExecutor *next = unlockedPickQueued();
+        if (!next) {
+            unlockedUpdateDispatchHints();
+            return nullptr;
+        }
+
+        if (!next->resumed.empty()) {
+            // resumed slots still hold the reference they had when suspended
+            slot = next->resumed.back();
+            next->resumed.pop_back();
+        } else {
+            slot = &next->slots[next->nextSlot++];
+            next->refs.fetch_add(1, std::memory_order_relaxed);
+            if (next->nextSlot == 1) {
+                workers[threadIndex].dispatchLatency.add(nowNs() - next->submitTime);
+                TS_TRACE(TE_TaskStarted, next->executor->traceId, next->executor->traceName, 0);
+            }
+        }
+        // count the worker as active right away so the next pick sees it
+        next->active.fetch_add(1, std::memory_order_relaxed);
+        if (next->nextSlot == next->slotCount && next->resumed.empty()) {
+            queue.erase(next);
+            next->queued = false;
+            dequeued = next;
+        }
+        unlockedUpdateDispatchHints();
+    }
+
+    if (dequeued) {
+        // the slot just taken still holds a reference, this can't be the last one
+        release(dequeued);
+    }
+    return slot;
+}
+
+void ThreadManager::stopExecutor(ScheduledExecutor *executor, Executor::StopReason reason) {
+    if (executor->stopped.exchange(true)) {
+        return;
+    }
+    executor->executor->stopReason = reason;
+
+    bool wasQueued = false;
+    std::vector<ExecutorSlot *> slots;
+    {
+        std::unique_lock<std::mutex> lock(queueMtx);
+        unlockedDrainSubmissions();
+        while (!executor->levelWeight) {
+            // cancelled while runThreadsNoWait is still pushing it, it has to be queued to be taken out
+            lock.unlock();
+            std::this_thread::yield();
+            lock.lock();
+            unlockedDrainSubmissions();
+        }
+        if (executor->queued) {
+            queue.erase(executor);
+            executor->queued = false;
+            wasQueued = true;
+        }
+        slots.swap(executor->resumed);
+        // the remaining executors with the same priority get the freed threads
+        executor->levelWeight->fetch_sub(executor->weight, std::memory_order_relaxed);
+        unlockedUpdateDispatchHints();
+    }
+    {
+        std::lock_guard<std::mutex> lock(executor->suspendMtx);
+        slots.insert(slots.end(), executor->suspended.begin(), executor->suspended.end());
+        executor->suspended.clear();
+    }
+
+    // slots no worker will step again
+    for (int c = 0; c < int(slots.size()); c++) {
+        release(executor);
+    }
+    if (wasQueued) {
+        release(executor);
+    }
+}
+
+bool ThreadManager::trySuspend(ScheduledExecutor *executor, ExecutorSlot *slot, uint64_t resumes) {
+    std::lock_guard<std::mutex> lock(executor->suspendMtx);
+    // checked under the mutex, both resume and stopExecutor change their flag before taking the list
+    if (executor->stopped.load() || executor->resumes.load() != resumes) {
+        return false;
+    }
+    executor->suspended.push_back(slot);
+    return true;
+}
+
+void ThreadManager::release(ScheduledExecutor *executor) {
+    if (executor->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    {
+        // a cancel that found the book-keeping before this either took its reference already or sees it at 0
+        std::lock_guard<std::mutex> lock(retireMtx);
+        executor->executor->scheduled.store(nullptr);
+    }
+
+    TS_TRACE(TE_TaskFinished, executor->executor->traceId, executor->executor->traceName, 0);
+    if (executor->onFinished) {
+        executor->onFinished();
+    }
+    delete executor;
+}
+
+ExecutorSlot *ThreadManager::steal(int threadIndex) {
+    Worker &worker = workers[threadIndex];
+    uint64_t &rng = worker.rng;
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    // [0, localVictims) are on the same node, slots stolen from them keep the executor data in the node's caches
+    const int groups[2][2] = {{0, worker.localVictims}, {worker.localVictims, int(worker.victims.size())}};
+    for (const auto &[begin, end] : groups) {
+        const int size = end - begin;
+        const int start = size > 0 ? int(rng % size) : 0;
+        for (int c = 0; c < size; c++) {
+            const int victim = worker.victims[begin + (start + c) % size];
+            if (ExecutorSlot *slot = workers[victim].deque.steal()) {
+                TS_TRACE(TE_Steal, slot->owner->executor->traceId, slot->owner->executor->traceName, victim);
+                return slot;
             }
+        }
+    }
+    return nullptr;
+}
+
+bool ThreadManager::hasWork() const {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (topPriority.load(std::memory_order_relaxed) != INT_MIN || !submissions.empty()) {
+        return true;
+    }
+    for (int c = 0; c < count; c++) {
+        if (!workers[c].deque.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadManager::pollForWork(int threadIndex, const std::function<bool()> *done) {
+    Worker &worker = workers[threadIndex];
+    const bool hot = threadIndex < hotWorkers.load(std::memory_order_relaxed);
+    const int64_t spin = spinNs.load(std::memory_order_relaxed);
+    const int64_t budget = spin + yieldNs.load(std::memory_order_relaxed);
+    if (!hot && budget == 0) {
+        return false;
+    }
+
+    // counted before the first check, a submitter that sees the count relies on this worker seeing its work
+    pollingCount.fetch_add(1);
+    bool found = false;
+    const int64_t start = nowNs();
+    while (running.load(std::memory_order_acquire)) {
+        if (hasWork() || (done && (*done)())) {
+            found = true;
+            break;
+        }
+        const int64_t elapsed = nowNs() - start;
+        if (elapsed < spin) {
+            // the clock is read once per batch, it costs more than a pause
+            for (int c = 0; c < 32; c++) {
+                cpuRelax();
+            }
+        } else if (hot || elapsed < budget) {
+            std::this_thread::yield();
+        } else {
+            break;
+        }
+    }
+    pollingCount.fetch_sub(1);
+
+    if (found) {
+        worker.spinHits.store(worker.spinHits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    return found;
+}
 
-            // just copy, and do not clear the value in @currentTask
-            // it is used to signal the task is completed
-            toExecute = currentTask[threadIndex];
+void ThreadManager::park(int threadIndex, const std::function<bool()> *done) {
+    Worker &worker = workers[threadIndex];
+    TS_TRACE(TE_ParkBegin, 0, nullptr, threadIndex);
+    worker.parks.store(worker.parks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    worker.state.store(WS_Parked);
+    parkedCount.fetch_add(1);
+
+    // re-check after announcing, anyone publishing work from now on will see this worker as parked
+    if (hasWork() || !running || (done && (*done)())) {
+        uint32_t expected = WS_Parked;
+        if (worker.state.compare_exchange_strong(expected, WS_Awake)) {
+            parkedCount.fetch_sub(1);
         }
+        worker.wokenAt.store(0, std::memory_order_relaxed);
+        TS_TRACE(TE_ParkEnd, 0, nullptr, threadIndex);
+        return;
+    }
+
+    worker.state.wait(WS_Parked);
+    // 0 if woken by @stop
+    const int64_t wokenAt = worker.wokenAt.exchange(0, std::memory_order_relaxed);
+    if (wokenAt != 0) {
+        worker.wakes.store(worker.wakes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        worker.wakeLatency.add(nowNs() - wokenAt);
+    }
+    TS_TRACE(TE_ParkEnd, 0, nullptr, threadIndex);
+}
+
+bool ThreadManager::wakeOne() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parkedCount.load() == 0) {
+        return false;
+    }
 
-        if (!running) {
+    const uint32_t start = wakeCursor.fetch_add(1, std::memory_order_relaxed);
+    const int64_t now = nowNs();
+    for (int c = 0; c < count; c++) {
+        if (tryWake(int((start + c) % count), now)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadManager::wakeWorkers(int wanted) {
+    // the polling count is read after the work is published, a worker that stops polling after this re-checks
+    // before parking
+    for (int c = pollingCount.load(); c < wanted; c++) {
+        if (!wakeOne() && !grow()) {
             return;
         }
+    }
+}
+
+bool ThreadManager::grow() {
+    if (!elastic) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(threadsMtx);
+    if (!running.load() || int(threads.size()) == count) {
+        return false;
+    }
+    threads.emplace_back(&ThreadManager::threadBase, this, int(threads.size()));
+    return true;
+}
+
+bool ThreadManager::tryWake(int threadIndex, int64_t start) {
+    Worker &worker = workers[threadIndex];
+    if (worker.state.load(std::memory_order_relaxed) != WS_Parked) {
+        return false;
+    }
+    // stored before the worker can see WS_Awake, a losing waker only overwrites it with a similar time
+    worker.wokenAt.store(start, std::memory_order_relaxed);
+    uint32_t expected = WS_Parked;
+    if (!worker.state.compare_exchange_strong(expected, WS_Awake)) {
+        return false;
+    }
+    parkedCount.fetch_sub(1);
+    TS_TRACE(TE_Wake, 0, nullptr, threadIndex);
+    worker.state.notify_one();
+    return true;
+}
+
+ExecutorSlot *ThreadManager::findWork(int threadIndex) {
+    while (running.load(std::memory_order_acquire)) {
+        if (ExecutorSlot *slot = tryFindWork(threadIndex)) {
+            return slot;
+        }
+        if (!pollForWork(threadIndex)) {
+            park(threadIndex);
+        }
+    }
+    return nullptr;
+}
+
+ExecutorSlot *ThreadManager::tryFindWork(int threadIndex) {
+    Worker &worker = workers[threadIndex];
+    while (true) {
+        ExecutorSlot *slot = worker.deque.pop();
+        if (slot && outranked(slot->owner)) {
+            // something more important is queued, leave this one for later
+            worker.deque.push(slot);
+            slot = nullptr;
+        }
 
-        assert(toExecute);
+        // slots taken from the queue are already counted as active
+        bool counted = false;
+        if (!slot) {
+            slot = takeQueued(threadIndex);
+            counted = slot != nullptr;
+        }
+        if (!slot) {
+            slot = steal(threadIndex);
+        }
+        if (!slot) {
+            return nullptr;
+        }
 
-        toExecute->ExecuteStep(threadIndex, int(threads.size()));
-        {
-            std::lock_guard<std::mutex> lock(workMtx);
-            currentTask[threadIndex] = nullptr;
+        if (!counted) {
+            slot->owner->active.fetch_add(1, std::memory_order_relaxed);
         }
+        if (slot->owner->stopped.load(std::memory_order_acquire)) {
+            slot->owner->active.fetch_sub(1, std::memory_order_relaxed);
+            release(slot->owner);
+            continue;
+        }
+        return slot;
+    }
+}
+
+bool ThreadManager::outranked(const ScheduledExecutor *executor) const {
+    const int top = topPriority.load(std::memory_order_relaxed);
+    // keys are all 0 under SP_Weighted
+    return top > executor->priority || (top == executor->priority && topKey.load(std::memory_order_relaxed) < executor->key);
+}
 
-        // Since start and finish share an event this must wake all threads
-        // to make sure the caller is awoken and not only some other worker
-        workEvent.notify_all();
+bool ThreadManager::shouldLeave(const ScheduledExecutor *executor) const {
+    const int priority = executor->priority;
+    if (outranked(executor)) {
+        return true;
     }
+
+    // same priority executor is waiting for threads while this one has more than it should
+    return balancePriority.load(std::memory_order_relaxed) == priority &&
+        balanceTarget.load(std::memory_order_relaxed) != executor &&
+        executor->active.load(std::memory_order_relaxed) > shareOf(executor);
 }
-bool ThreadManager::unlockedAllTasksDone() const {
-    for (int c = 0; c < currentTask.size(); c++) {
-        if (currentTask[c]) {
-            return false;
+
+bool ThreadManager::stepSlot(int threadIndex, ExecutorSlot *slot, const std::function<bool()> *done) {
+    Worker &worker = workers[threadIndex];
+    ScheduledExecutor *owner = slot->owner;
+    Executor::ExecStatus status = Executor::ES_Continue;
+    bool leave = false;
+    while (status == Executor::ES_Continue && !leave && !owner->stopped.load(std::memory_order_acquire)) {
+        if (owner->deadline != INT64_MAX && nowNs() >= owner->deadline) {
+            stopExecutor(owner, Executor::SR_Expired);
+            break;
+        }
+        const uint64_t resumes = owner->resumes.load();
+        TS_TRACE(TE_StepBegin, owner->executor->traceId, owner->executor->traceName, slot->index);
+        ExecutorSlot *outer = worker.stepping;
+        worker.stepping = slot;
+        status = owner->executor->ExecuteStep(slot->index, owner->slotCount);
+        worker.stepping = outer;
+        TS_TRACE(TE_StepEnd, owner->executor->traceId, owner->executor->traceName, status);
+        if (status == Executor::ES_Suspend) {
+            // not active while set aside, and the owner can't be touched once the slot is in the suspended list
+            owner->active.fetch_sub(1, std::memory_order_relaxed);
+            if (trySuspend(owner, slot, resumes)) {
+                // the reference went to the suspended list
+                return false;
+            }
+            // resumed while stepping, the executor could have work for the slot again
+            owner->active.fetch_add(1, std::memory_order_relaxed);
+            status = Executor::ES_Continue;
         }
+        // priorities and shares are re-checked between steps, the worker can be taken over by a waiting executor
+        // a helping worker also goes back to the step it helps from as soon as its wait is over
+        leave = shouldLeave(owner) || (done && (*done)());
     }
+
+    owner->active.fetch_sub(1, std::memory_order_relaxed);
+    if (status == Executor::ES_Stop) {
+        stopExecutor(owner, owner->executor->IsCancelled() ? Executor::SR_Cancelled : Executor::SR_Stopped);
+    }
+
+    if (owner->stopped.load(std::memory_order_acquire)) {
+        release(owner);
+        return false;
+    }
+    // the preempted slot can be resumed by any idle worker
+    worker.deque.push(slot);
+    wakeWorkers(1);
     return true;
 }
 
-};
\ No newline at end of file
+void ThreadManager::threadBase(int threadIndex) {
+    ExecutorSlot *current = nullptr;
+    currentManager = this;
+    currentThreadIndex = threadIndex;
+    if (!PinCurrentThread(placement[threadIndex].cpus)) {
+        unpinnedCount.fetch_add(1);
+    }
+    placedCount.fetch_add(1);
+    placedCount.notify_all();
+    TS_TRACE_WORKER_BEGIN(threadIndex);
+    while (true) {
+        if (!current) {
+            current = findWork(threadIndex);
+        }
+
+        if (!current) {
+            TS_TRACE_WORKER_END();
+            return;
+        }
+
+        // a slot that was left goes to the deque, the queued executor that took the worker over is attached right away
+        current = stepSlot(threadIndex, current, nullptr) ? takeQueued(threadIndex) : nullptr;
+    }
+}
+
+};
@@ -1,30 +1,78 @@
 #pragma once
 
 #include "Task.h"
+#include "Trace.h"
+#include "MPMCQueue.h"
+#include "Topology.h"
+#include "ObjectPool.h"
+#include "LatencyHistogram.h"
+#include "WorkStealingDeque.h"
 #include <mutex>
-#include <queue>
+#include <map>
+#include <set>
+#include <atomic>
+#include <climits>
 #include <memory>
 #include <vector>
+#include <chrono>
 #include <thread>
 #include <functional>
-#include <condition_variable>
 
 
 namespace TaskSystem {
 class ThreadManager;
+struct ScheduledExecutor;
 
-struct Executor {
+struct Executor : PoolAllocated {
     enum ExecStatus {
-        ES_Continue, ES_Stop
+        ES_Continue, ES_Stop,
+        ES_Suspend, ///< Nothing to do for this threadIndex until ThreadManager::resume is called for the executor
+    };
+
+    /// Why the ThreadManager retired the executor
+    enum StopReason {
+        SR_Stopped, ///< A step returned ES_Stop
+        SR_Cancelled, ///< ThreadManager::cancel, or a step returned ES_Stop after it
+        SR_Expired, ///< The @deadline passed before the executor stopped
     };
  
     Executor(std::unique_ptr<Task> taskToExecute) : task(std::move(taskToExecute)) {}
     virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) = 0;
+
+    /// Called by ThreadManager::cancel, possibly while steps are running, and by the executor itself
+    /// @return true if the executor can be dropped between steps right away, false while something outside still
+    ///         holds it, like a callback that resumes it. It is then stepped as usual and should stop by itself
+    ///         once it can, checking IsCancelled and calling TryCancel from its steps
+    virtual bool TryCancel() { return true; }
+
+    /// Set by ThreadManager::cancel
+    bool IsCancelled() const { return cancelled.load(std::memory_order_relaxed); }
+
+    /// Why the executor was retired, valid in the finish callback given to ThreadManager::runThreadsNoWait
+    StopReason GetStopReason() const { return stopReason; }
         
     inline void runOn(ThreadManager &tm);
     virtual ~Executor() {}
 
     std::unique_ptr<Task> task;
+
+    /// Number of thread indices the executor is stepped with, capped to the number of workers
+    /// Executors that can't use more threads set it in their constructor, no worker attaches to the extra slots
+    int maxThreads = INT_MAX;
+
+    /// No step is started after this time, the executor is retired with SR_Expired instead, must be set before
+    /// scheduling. Also orders the executors with the same priority under SP_EarliestDeadline
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+private:
+    friend class ThreadManager;
+    friend class TaskSystemExecutor;
+    std::atomic<ScheduledExecutor *> scheduled = nullptr; ///< Book-keeping of the ThreadManager, set once scheduled
+    std::atomic<bool> cancelled = false;
+    StopReason stopReason = SR_Stopped; ///< Written once, by the thread that stopped the executor
+#ifdef TS_ENABLE_TRACING
+    uint64_t traceId = 0; ///< TaskID of the task, 0 if not scheduled through TaskSystemExecutor
+    const char *traceName = nullptr; ///< Name of the executor in the trace
+#endif
 };
 
 struct CallbackFunctor {
@@ -48,60 +96,313 @@ struct CallbackFunctor {
 typedef Executor*(*ExecutorConstructor)(std::unique_ptr<Task> taskToExecute);
 struct TaskSystemExecutor;
 
+/// Which pool steps the executors of a type, declared at TaskSystemExecutor::Register
+enum ExecutorClass {
+	EC_Compute, ///< CPU bound steps, run on the compute workers, one for each core
+	EC_Blocking, ///< Steps that sleep or wait for I/O, run on the elastic blocking pool so they do not hold compute workers
+};
+
+
+struct ExecutorSlot;
+
+/// How idle workers wait for work, polling first so bursts of short tasks do not pay for a kernel wake each
+struct IdlePolicy {
+	std::chrono::nanoseconds spin = std::chrono::microseconds(20); ///< Polling with a pause instruction between checks
+	std::chrono::nanoseconds yield = std::chrono::microseconds(50); ///< Polling with yielding the CPU, after spinning
+	int hotWorkers = 0; ///< Workers [0, hotWorkers) never park, they poll until stopped, for low latency deployments
+};
+
+/// Order in which workers take queued executors with the same priority, higher priorities always go first
+enum SchedulingPolicy {
+	SP_Weighted, ///< Submission order, the running executors split the threads by their weight
+	SP_EarliestDeadline, ///< Earliest Executor::deadline first, the ones without a deadline last in submission order.
+	                     ///< Workers leave an executor for a queued one with an earlier deadline
+};
+
+/// Counters of the idle strategy, totals over all workers since start
+struct IdleStats {
+	uint64_t spinHits = 0; ///< Times a polling worker found work, each one saved a park and a wake
+	uint64_t parks = 0;
+	uint64_t wakes = 0;
+	int64_t wakeP50Ns = 0; ///< From waking a parked worker to it running again
+	int64_t wakeP99Ns = 0;
+	int64_t dispatchP50Ns = 0; ///< From scheduling an executor to a worker attaching to its first slot
+	int64_t dispatchP99Ns = 0;
+};
 
-/// Non re-entrant task runner
+/// Pool of worker threads that step scheduled executors in priority order
+/// Each executor is stepped with threadIndex in [0, threadCount) where threadCount is the number of workers,
+/// or Executor::maxThreads if that is lower, a given threadIndex is never stepped by two workers at the same time
+///
+/// Newly scheduled executors are pushed to a lock-free submission queue, workers move them to a priority ordered
+/// queue where they wait until workers attach to their slots (threadIndex).
+/// A worker keeps stepping its slot without any locking until the executor stops or a higher priority one is
+/// queued. Preempted slots go to the worker's own work stealing deque where idle workers can steal them.
+/// Idle workers poll for a short while and then park on their own atomic, parked ones are woken one by one,
+/// only when there is work for them that the polling workers will not pick up.
+/// Workers can be pinned to CPUs with a ThreadPlacement, stealing prefers victims on the same NUMA node.
+/// An elastic instance starts no threads up front, a worker is started whenever there is work and no idle worker
+/// to wake, up to the thread count. The blocking pool is one, so sleeping executors never oversubscribe the cores.
+///
+/// Any number of executors can run at the same time. Executors with the same priority split the threads
+/// proportionally to their weight: a worker on an executor above its share moves to a queued one below it.
+/// With SP_EarliestDeadline they go to the earliest deadline instead.
+/// Threads of an executor that returned ES_Stop move on to other executors right away.
+/// A slot that returned ES_Suspend is set aside until the executor is resumed and then queued again.
+/// Executors that are cancelled or past their deadline are stopped between steps the same way.
 class ThreadManager {
-	explicit ThreadManager(int threadCount)
-		: count(threadCount)
-	{}
+	explicit ThreadManager(std::vector<ThreadPlacement::Worker> placement, bool elastic = false)
+		: count(int(placement.size()))
+		, placement(std::move(placement))
+		, elastic(elastic)
+	{
+		setIdlePolicy(IdlePolicy());
+	}
 public:
 	ThreadManager(const ThreadManager &) = delete;
 	ThreadManager& operator=(const ThreadManager &) = delete;
+	~ThreadManager();
+
+    /// Upper limit of the blocking pool threads, they are only started when blocking executors need them
+    static constexpr int defaultBlockingThreads = 64;
 
-    static void Init(int threadCount);
+    /// Create the instance with @threadCount unpinned threads, and the blocking pool with up to @blockingThreads
+    static void Init(int threadCount, int blockingThreads = defaultBlockingThreads);
 
+    /// Create the instance with threads placed on the CPUs according to @placement, the blocking pool is not pinned
+    static void Init(const ThreadPlacement &placement, int blockingThreads = defaultBlockingThreads);
+
+    /// The compute workers
     static ThreadManager &GetInstance();
 
+    /// The elastic pool for executors registered as EC_Blocking
+    static ThreadManager &GetBlockingInstance();
+
 	/// Start up all threads, must be called before @runThreads is called
+	/// Returns once every thread applied its placement, see @getUnpinnedCount
 	void start();
 
-	/// Schedule the task to be run by the threads and return immediatelly
-	/// This function could return before the threads have actually started running the task!
-	void runThreadsNoWait(TaskSystem::Executor &task);
+	/// Schedule the executor to be stepped by the threads until it returns ES_Stop and return immediatelly
+	/// This function could return before the threads have actually started running the executor!
+	/// @param task - the executor to run, must stay alive until @onFinished is called
+	/// @param priority - idle threads always attach to the highest priority executor with free thread slots
+	/// @param weight - share of the threads compared to other executors with the same priority
+	/// @param onFinished - called on the worker that retires the executor, after all of its steps have returned
+	void runThreadsNoWait(TaskSystem::Executor &task, int priority = 0, int weight = 1, std::function<void()> onFinished = nullptr);
 
-	/// Start a task on all threads and wait for all of them to finish
-	/// @param task - the task to run on all threads
-	void runThreads(TaskSystem::Executor &task);
+	/// Run an executor on all threads until it returns ES_Stop and wait for it to finish
+	/// Called from a worker thread, inside ExecuteStep, the worker runs other work while waiting, see @helpUntil
+	/// @param task - the executor to run on all threads
+	/// @param priority - the priority of the executor
+	void runThreads(TaskSystem::Executor &task, int priority = 0);
 
-	/// Blocking wait for all threads to exit, does not interrupt any running Task
+	/// Hand the slots of @task that returned ES_Suspend back to the workers, slots that are in the middle of
+	/// a step that will return ES_Suspend are not suspended, so the executor can change its state and resume
+	/// at any time. Calling it for an executor that is not scheduled yet does nothing.
+	/// Can be called on any instance, the executor is handed back to the one it was scheduled on.
+	/// Must not be called after the executor could have finished
+	void resume(TaskSystem::Executor &task);
+
+	/// Stop the executor between steps as if one returned ES_Stop, unless Executor::TryCancel declines
+	/// Running steps are not interrupted, no new step is started and the executor is retired with SR_Cancelled
+	/// once they return, its suspended and queued slots are dropped right away.
+	/// Can be called on any instance. The executor must be alive, does nothing if it is not scheduled or retiring
+	void cancel(TaskSystem::Executor &task);
+
+	/// Blocking wait for all threads to exit, does not interrupt any running step
 	void stop();
 
-	/// Get the number of worker threads
+	/// Get the number of worker threads, for an elastic instance the most it starts
 	int getThreadCount() const;
 
+	/// Get the NUMA node the worker with @threadIndex is placed on, 0 if it is not pinned
+	int getWorkerNode(int threadIndex) const;
+
+	/// Get the number of workers that could not be pinned to the CPUs of their placement, they run wherever the OS
+	/// places them. Always 0 for unpinned threads, valid once @start returned
+	int getUnpinnedCount() const;
+
+	/// Get the index of the worker running on the calling thread, -1 if the caller is not one of the workers
+	int getCurrentThreadIndex() const;
+
+	/// Step other executors on the calling worker until @done returns true, for waiting inside ExecuteStep
+	/// A blocked worker could be the one the awaited work needs, so it helps instead: it takes slots from its deque,
+	/// the queue and the other workers, and parks only when there is nothing to run. Whatever makes @done true must
+	/// call @wakeWorker afterwards. The slot the caller is stepping stays attached to it for the whole wait.
+	/// The awaited work must not depend on the step that is waiting, as with spawning children and joining them:
+	/// the helped work runs on top of the waiting step, which continues only after it returns
+	/// @param threadIndex - @getCurrentThreadIndex of the caller
+	/// @param done - checked between steps and before parking, must not block
+	void helpUntil(int threadIndex, const std::function<bool()> &done);
+
+	/// Wake the worker if it is parked, used to end @helpUntil; an idle worker woken this way parks again
+	void wakeWorker(int threadIndex);
+
+	/// Change how idle workers wait, can be called at any time, also used by @runThreads while waiting
+	void setIdlePolicy(const IdlePolicy &policy);
+
+	IdleStats getIdleStats() const;
+
+	/// Change the order of the queued executors with the same priority, can be called at any time,
+	/// executors scheduled before the change keep the order they were scheduled with
+	void setSchedulingPolicy(SchedulingPolicy policy);
+
 private:
+	enum WorkerState : uint32_t {
+		WS_Awake, WS_Parked
+	};
+
+	/// State owned by a single worker, aligned so workers do not share cache lines
+	struct alignas(64) Worker {
+		WorkStealingDeque<ExecutorSlot> deque; ///< Slots preempted on this worker, open for stealing
+		std::atomic<uint32_t> state = WS_Awake; ///< Parked worker waits on this until someone sets it to WS_Awake
+		uint64_t rng = 0; ///< State for picking steal victims
+		std::vector<int> victims; ///< Other workers, the ones on the same node first
+		int localVictims = 0; ///< Number of @victims on the same node
+		ExecutorSlot *stepping = nullptr; ///< Slot in ExecuteStep on this worker, the innermost one while helping
+
+		std::atomic<int64_t> wokenAt = 0; ///< Time @wakeOne woke this worker
+		std::atomic<uint64_t> spinHits = 0;
+		std::atomic<uint64_t> parks = 0;
+		std::atomic<uint64_t> wakes = 0;
+		LatencyHistogram wakeLatency; ///< Written only by the worker itself
+		LatencyHistogram dispatchLatency; ///< Executors this worker attached to first
+	};
+
     static ThreadManager *self;
+    static ThreadManager *blockingSelf;
 	/// The entry point for all of the threads
 	/// @param threadIndex - the 0 based index of the thread
-	void threadBase(volatile int threadIndex);
+	void threadBase(int threadIndex);
+
+	/// Get the next slot to step: own deque, then the queue, then steal, park if there is nothing
+	/// @return the slot or nullptr if the threads are stopping
+	ExecutorSlot *findWork(int threadIndex);
+
+	/// Same as @findWork without polling or parking
+	/// @return the slot, already counted as active, or nullptr if there is nothing to run right now
+	ExecutorSlot *tryFindWork(int threadIndex);
+
+	/// Step the slot until its executor stops, the slot suspends or the worker should leave it
+	/// @param done - leave the slot once it returns true, nullptr when not called from @helpUntil
+	/// @return true if the worker left the slot and pushed it to its deque
+	bool stepSlot(int threadIndex, ExecutorSlot *slot, const std::function<bool()> *done);
+
+	/// Attach to the next free slot of the highest priority queued executor, furthest below its share
+	/// @return the slot or nullptr if the queue is empty
+	ExecutorSlot *takeQueued(int threadIndex);
+
+	/// Pick the queued executor workers should attach to next, must be called with @queueMtx locked
+	ScheduledExecutor *unlockedPickQueued() const;
+
+	/// Number of threads @executor should get, based on its weight and the total weight of its priority
+	int shareOf(const ScheduledExecutor *executor) const;
+
+	/// Try to steal a slot from the other workers, the ones on the same node first, each group from a random victim
+	ExecutorSlot *steal(int threadIndex);
+
+	/// Check if a queued executor goes before @executor, by priority or by deadline under SP_EarliestDeadline
+	bool outranked(const ScheduledExecutor *executor) const;
+
+	/// Check if a worker stepping @executor should move to a queued executor that outranks it or
+	/// one with the same priority that is below its share of the threads
+	bool shouldLeave(const ScheduledExecutor *executor) const;
 
-	/// Check if all elements in @currentTask are nullptr
-	/// @return true if at least one task is not nullptr, false otherwise
-	bool unlockedAllTasksDone() const;
+	/// Check if there is anything for an idle worker to pick up
+	bool hasWork() const;
+
+	/// Poll for work according to the idle policy before parking
+	/// @param done - also stop polling once it returns true, for workers in @helpUntil
+	/// @return true if there is work or @done, false if the budget ran out or the threads are stopping
+	bool pollForWork(int threadIndex, const std::function<bool()> *done = nullptr);
+
+	/// Block the worker until it is woken up by @wakeOne, @wakeWorker or @stop
+	/// @param done - checked after announcing the park like the work is, nullptr if not in @helpUntil
+	void park(int threadIndex, const std::function<bool()> *done = nullptr);
+
+	/// Wake parked workers for up to @wanted new slots, polling workers count as woken
+	/// An elastic instance starts new workers when none is parked
+	void wakeWorkers(int wanted);
+
+	/// Start one more worker if this is an elastic instance below its thread count
+	/// @return false if no worker was started
+	bool grow();
+
+	/// Wake up the worker if it is parked, @start is the time the wake was requested at
+	/// @return false if the worker was not parked
+	bool tryWake(int threadIndex, int64_t start);
+
+	/// Wake up a single parked worker
+	/// @return false if no worker was parked
+	bool wakeOne();
+
+	/// Put the slot aside until the executor is resumed, unless it was resumed or stopped after @resumes was read
+	/// @return true if the slot was suspended, its reference is now owned by the suspended list
+	bool trySuspend(ScheduledExecutor *executor, ExecutorSlot *slot, uint64_t resumes);
+
+	/// Mark executor as stopped and drop the queue's reference to it
+	/// @param reason - kept for the finish callback if this call is the one that stopped the executor
+	void stopExecutor(ScheduledExecutor *executor, Executor::StopReason reason);
+
+	/// Drop one reference to the executor, the last one calls the finish callback and frees the book-keeping
+	void release(ScheduledExecutor *executor);
+
+	/// Refresh @topPriority and @balanceTarget after @queue is modified, must be called with @queueMtx locked
+	/// Moves all new submissions to the queue first
+	void unlockedUpdateDispatchHints();
+
+	/// Move executors from @submissions to @queue, must be called with @queueMtx locked
+	void unlockedDrainSubmissions();
+
+	/// Add a newly submitted executor to @queue and to the weight of its priority, must be called with @queueMtx locked
+	void unlockedInsert(ScheduledExecutor *executor);
+
+	/// Orders @queue by priority, executors with the same priority by their deadline under SP_EarliestDeadline,
+	/// then in submission order
+	struct QueueOrder {
+		bool operator()(const ScheduledExecutor *a, const ScheduledExecutor *b) const;
+	};
 
 	int count = -1; ///< The number of threads
+	std::vector<ThreadPlacement::Worker> placement; ///< CPUs and node of each thread
+	const bool elastic = false; ///< Threads are started on demand by @grow
+	std::mutex threadsMtx; ///< Protects @threads, an elastic instance adds to it while running
 	std::vector<std::thread> threads; ///< The thread handles
+	std::unique_ptr<Worker[]> workers; ///< Per thread state, indexed with the thread index
+
+	std::atomic<bool> running = false; ///< Flag indicating if threads should quit
+	std::atomic<int> placedCount = 0; ///< Number of threads that tried to apply their placement, @start waits for all
+	std::atomic<int> unpinnedCount = 0; ///< Number of threads that failed to
+	std::atomic<int> parkedCount = 0; ///< Number of workers in WS_Parked state
+	std::atomic<int> pollingCount = 0; ///< Number of workers in @pollForWork, they pick up new work without a wake
+	std::atomic<int64_t> spinNs = 0; ///< IdlePolicy::spin
+	std::atomic<int64_t> yieldNs = 0; ///< IdlePolicy::yield
+	std::atomic<int> hotWorkers = 0; ///< IdlePolicy::hotWorkers
+	std::atomic<uint32_t> wakeCursor = 0; ///< Rotates the first worker checked by @wakeOne
+	std::atomic<int> schedulingPolicy = SP_Weighted; ///< Policy for the executors scheduled from now on
+
+	/// Executors scheduled since the last time a worker looked at the queue, submitting takes no locks
+	/// The submitter raises @topPriority after the push, so workers notice the new executor between steps
+	MPMCQueue<ScheduledExecutor> submissions = MPMCQueue<ScheduledExecutor>(4096);
+	std::atomic<uint64_t> submitted = 0; ///< Number of executors ever scheduled, used for FIFO order in @queue
 
-	bool running = false; ///< Flag indicating if threads should quit
+	/// Executors that still have thread slots no worker was attached to
+	std::set<ScheduledExecutor *, QueueOrder> queue;
+	/// Sum of the weights of the not stopped executors for every priority ever scheduled, entries are never removed
+	/// Inserted with @queueMtx locked, the values are read without locking to compute shares between steps
+	std::map<int, std::atomic<int>> levelWeights;
+	std::mutex queueMtx; ///< Mutex protecting @queue and @levelWeights, not touched while stepping executors
 
-	/// The current task for each thread, always must be the same element
-	/// Used to track if thread has finished working
-	std::vector<Executor *> currentTask;
-	std::mutex workMtx; ///< Mutex protecting @currentTask and @running
+	/// Priority of the first executor in @queue, checked by workers between steps without locking
+	/// A worker stepping lower priority executor detaches from it and attaches to the queued one
+	std::atomic<int> topPriority = INT_MIN;
+	/// Queue key of the same executor, a deadline under SP_EarliestDeadline, 0 under SP_Weighted
+	std::atomic<int64_t> topKey = INT64_MAX;
 
-	/// The event used to signal workers when new task is available
-	/// Also used by workers to signal when task is finished
-	std::condition_variable workEvent;
+	/// Queued executor that is below its share of the threads, workers on executors with the same priority
+	/// that are above their share move to it. Only compared against, never dereferenced outside of @queueMtx
+	std::atomic<ScheduledExecutor *> balanceTarget = nullptr;
+	std::atomic<int> balancePriority = INT_MIN; ///< Priority of @balanceTarget
 };
 
 
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <bit>
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+
+namespace TaskSystem {
+
+/// Log scale histogram of durations, 4 buckets for each power of 2 nanoseconds, so percentiles are within 25%
+/// Written by a single thread without atomic read-modify-write, can be read from any thread at any time
+class LatencyHistogram {
+public:
+	static constexpr int bucketCount = 64 * 4;
+
+	void add(int64_t ns) {
+		std::atomic<uint64_t> &bucket = buckets[bucketOf(ns)];
+		bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	/// Add the counts of this histogram to @counts
+	void mergeInto(uint64_t (&counts)[bucketCount]) const {
+		for (int c = 0; c < bucketCount; c++) {
+			counts[c] += buckets[c].load(std::memory_order_relaxed);
+		}
+	}
+
+	/// Lower bound of the bucket holding the @fraction rank of @counts, 0 if there are no samples
+	static int64_t percentile(const uint64_t (&counts)[bucketCount], double fraction) {
+		uint64_t total = 0;
+		for (int c = 0; c < bucketCount; c++) {
+			total += counts[c];
+		}
+		const uint64_t rank = uint64_t(double(total) * fraction);
+		uint64_t seen = 0;
+		for (int c = 0; c < bucketCount; c++) {
+			seen += counts[c];
+			if (seen > rank) {
+				return bucketValue(c);
+			}
+		}
+		return 0;
+	}
+
+	static int bucketOf(int64_t ns) {
+		if (ns < 4) {
+			return int(std::max<int64_t>(ns, 0));
+		}
+		const int msb = std::bit_width(uint64_t(ns)) - 1;
+		return msb * 4 + int((ns >> (msb - 2)) & 3);
+	}
+
+	static int64_t bucketValue(int bucket) {
+		const int msb = bucket / 4;
+		if (msb < 2) {
+			return bucket;
+		}
+		return int64_t(4 + bucket % 4) << (msb - 2);
+	}
+
+private:
+	std::atomic<uint64_t> buckets[bucketCount] = {};
+};
+
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+namespace TaskSystem {
+
+/// Bounded lock-free queue of pointers, any number of threads can push and pop
+/// Implementation follows Dmitry Vyukov's bounded MPMC queue: each cell has a sequence number telling
+/// whether it is free for the producer or full for the consumer of the current lap
+template <typename T>
+class MPMCQueue {
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T *item;
+	};
+public:
+	/// @param capacity - must be power of 2
+	explicit MPMCQueue(size_t capacity)
+		: mask(capacity - 1)
+		, cells(new Cell[capacity])
+	{
+		assert(capacity >= 2 && (capacity & mask) == 0 && "Capacity must be power of 2");
+		for (size_t c = 0; c < capacity; c++) {
+			cells[c].sequence.store(c, std::memory_order_relaxed);
+		}
+	}
+
+	MPMCQueue(const MPMCQueue &) = delete;
+	MPMCQueue &operator=(const MPMCQueue &) = delete;
+
+	/// @return false if the queue is full
+	bool tryPush(T *item) {
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		Cell *cell = nullptr;
+		while (true) {
+			cell = &cells[pos & mask];
+			const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			const intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+			if (diff == 0) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+		cell->item = item;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// @return the oldest item or nullptr if the queue is empty, or the oldest item is not fully pushed yet
+	T *tryPop() {
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		Cell *cell = nullptr;
+		while (true) {
+			cell = &cells[pos & mask];
+			const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			const intptr_t diff = intptr_t(sequence) - intptr_t(pos + 1);
+			if (diff == 0) {
+				if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return nullptr;
+			} else {
+				pos = dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+		T *item = cell->item;
+		cell->sequence.store(pos + mask + 1, std::memory_order_release);
+		return item;
+	}
+
+	/// Approximate check, the result can be outdated by the time it is used
+	bool empty() const {
+		return enqueuePos.load(std::memory_order_relaxed) == dequeuePos.load(std::memory_order_relaxed);
+	}
+
+private:
+	const size_t mask;
+	std::unique_ptr<Cell[]> cells;
+	alignas(64) std::atomic<size_t> enqueuePos = 0;
+	alignas(64) std::atomic<size_t> dequeuePos = 0;
+};
+
+};
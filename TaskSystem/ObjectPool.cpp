@@ -0,0 +1,152 @@
+#include "ObjectPool.h"
+
+#include <mutex>
+#include <vector>
+#include <cassert>
+
+namespace TaskSystem {
+
+namespace {
+
+const int classCount = 6; ///< Size classes of 64, 128, ... 2048 bytes
+const size_t maxPooledSize = ObjectPool::blockAlign << (classCount - 1);
+const int batchSize = 32; ///< Number of blocks moved between a thread and the shared list at once
+const size_t slabSize = 64 * 1024;
+
+struct FreeBlock {
+	FreeBlock *next;
+};
+
+/// Chain of free blocks linked through FreeBlock::next
+struct Batch {
+	FreeBlock *head = nullptr;
+	int count = 0;
+};
+
+/// Batches returned by all threads, never freed so objects can be released during static destruction
+struct SharedLists {
+	std::mutex mtx[classCount];
+	std::vector<Batch> batches[classCount];
+};
+
+SharedLists &shared() {
+	static SharedLists *lists = new SharedLists;
+	return *lists;
+}
+
+int sizeClass(size_t size) {
+	int index = 0;
+	for (size_t classSize = ObjectPool::blockAlign; classSize < size; classSize <<= 1) {
+		index++;
+	}
+	return index;
+}
+
+/// Set once the cache of the thread is destroyed, objects can still be created and freed during thread exit
+thread_local bool cacheDestroyed = false;
+
+/// Free blocks owned by a single thread
+struct ThreadCache {
+	Batch lists[classCount];
+
+	~ThreadCache() {
+		cacheDestroyed = true;
+		for (int c = 0; c < classCount; c++) {
+			if (lists[c].count) {
+				std::lock_guard<std::mutex> lock(shared().mtx[c]);
+				shared().batches[c].push_back(lists[c]);
+			}
+		}
+	}
+
+	/// Get a batch from the shared list or carve a new slab
+	void refill(int index) {
+		{
+			std::lock_guard<std::mutex> lock(shared().mtx[index]);
+			std::vector<Batch> &batches = shared().batches[index];
+			if (!batches.empty()) {
+				lists[index] = batches.back();
+				batches.pop_back();
+				return;
+			}
+		}
+
+		const size_t blockSize = ObjectPool::blockAlign << index;
+		char *slab = static_cast<char *>(::operator new(slabSize, std::align_val_t(ObjectPool::blockAlign)));
+		for (size_t offset = 0; offset + blockSize <= slabSize; offset += blockSize) {
+			FreeBlock *block = reinterpret_cast<FreeBlock *>(slab + offset);
+			block->next = lists[index].head;
+			lists[index].head = block;
+			lists[index].count++;
+		}
+	}
+
+	/// Move a batch to the shared list once the thread holds more than it is likely to reuse
+	void trim(int index) {
+		Batch batch;
+		for (int c = 0; c < batchSize; c++) {
+			FreeBlock *block = lists[index].head;
+			lists[index].head = block->next;
+			block->next = batch.head;
+			batch.head = block;
+		}
+		batch.count = batchSize;
+		lists[index].count -= batchSize;
+
+		std::lock_guard<std::mutex> lock(shared().mtx[index]);
+		shared().batches[index].push_back(batch);
+	}
+};
+
+thread_local ThreadCache cache;
+
+};
+
+void *ObjectPool::allocate(size_t size) {
+	if (size > maxPooledSize) {
+		return ::operator new(size, std::align_val_t(blockAlign));
+	}
+
+	const int index = sizeClass(size);
+	if (cacheDestroyed) {
+		// a whole block, so it can go to the free lists later
+		return ::operator new(blockAlign << index, std::align_val_t(blockAlign));
+	}
+
+	Batch &list = cache.lists[index];
+	if (!list.head) {
+		cache.refill(index);
+	}
+	FreeBlock *block = list.head;
+	list.head = block->next;
+	list.count--;
+	return block;
+}
+
+void ObjectPool::deallocate(void *ptr, size_t size) {
+	if (!ptr) {
+		return;
+	}
+	if (size > maxPooledSize) {
+		::operator delete(ptr, std::align_val_t(blockAlign));
+		return;
+	}
+
+	const int index = sizeClass(size);
+	FreeBlock *block = static_cast<FreeBlock *>(ptr);
+	if (cacheDestroyed) {
+		block->next = nullptr;
+		std::lock_guard<std::mutex> lock(shared().mtx[index]);
+		shared().batches[index].push_back(Batch{block, 1});
+		return;
+	}
+
+	Batch &list = cache.lists[index];
+	block->next = list.head;
+	list.head = block;
+	if (++list.count > 2 * batchSize) {
+		cache.trim(index);
+	}
+}
+
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <new>
+#include <cstddef>
+
+namespace TaskSystem {
+
+/// Size class allocator for small objects that are created on one thread and usually freed on another, like
+/// tasks and executors. Each thread keeps a free list per size class and exchanges batches of blocks with a
+/// shared list, so most allocations and frees do not touch any shared state
+class ObjectPool {
+public:
+	/// Alignment of all pooled blocks
+	static constexpr size_t blockAlign = 64;
+
+	/// @return memory aligned to @blockAlign, taken from the pool if @size is small enough
+	static void *allocate(size_t size);
+
+	/// @param size - must be the size that was passed to allocate
+	static void deallocate(void *ptr, size_t size);
+};
+
+/// Base for classes allocated through the ObjectPool, deleting through a base pointer needs a virtual destructor
+/// so the size of the most derived class is passed to operator delete
+struct PoolAllocated {
+	static void *operator new(size_t size) {
+		return ObjectPool::allocate(size);
+	}
+
+	static void *operator new(size_t size, std::align_val_t align) {
+		if (size_t(align) <= ObjectPool::blockAlign) {
+			return ObjectPool::allocate(size);
+		}
+		return ::operator new(size, align);
+	}
+
+	static void operator delete(void *ptr, size_t size) {
+		ObjectPool::deallocate(ptr, size);
+	}
+
+	static void operator delete(void *ptr, size_t size, std::align_val_t align) {
+		if (size_t(align) <= ObjectPool::blockAlign) {
+			ObjectPool::deallocate(ptr, size);
+		} else {
+			::operator delete(ptr, size, align);
+		}
+	}
+};
+
+};
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "Executor.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <functional>
+
+namespace TaskSystem {
+
+/// Index range [begin, end) claimed in chunks by the threads stepping an executor, with a single atomic counter
+/// The chunk size adapts per thread: it grows until a chunk takes about @targetChunkTime so cheap bodies do not
+/// pay for a claim per index, and it shrinks near the end of the range so all threads finish at about the same time
+class ParallelRange {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/// Long enough to hide the cost of a claim, short enough to keep preemption between steps responsive
+	static constexpr Clock::duration targetChunkTime = std::chrono::microseconds(100);
+
+	/// @param threadCount - number of thread indices that will claim from the range
+	/// @param maxGrain - upper limit of the chunk size
+	ParallelRange(int64_t begin, int64_t end, int threadCount, int64_t maxGrain = INT64_MAX)
+		: next(begin)
+		, end(end)
+		, threadCount(threadCount)
+		, maxGrain(maxGrain)
+		, threads(new ThreadState[threadCount])
+	{
+		assert(threadCount > 0 && maxGrain > 0);
+	}
+
+	ParallelRange(const ParallelRange &) = delete;
+	ParallelRange &operator=(const ParallelRange &) = delete;
+
+	/// Claim the next chunk and call @body(index) for each index in it, must not be called for the same
+	/// @threadIndex from two threads at once, which the ThreadManager guarantees for ExecuteStep
+	/// @return number of indices processed, 0 once the range is exhausted
+	template <typename Body>
+	int64_t runChunk(int threadIndex, Body &&body) {
+		assert(threadIndex >= 0 && threadIndex < threadCount);
+		ThreadState &state = threads[threadIndex];
+
+		int64_t chunkBegin = next.load(std::memory_order_relaxed);
+		int64_t chunkEnd = chunkBegin;
+		do {
+			if (chunkBegin >= end) {
+				return 0;
+			}
+			const int64_t tail = std::max<int64_t>(1, (end - chunkBegin) / (2 * threadCount));
+			chunkEnd = chunkBegin + std::min({state.grain, tail, maxGrain});
+		} while (!next.compare_exchange_weak(chunkBegin, chunkEnd, std::memory_order_relaxed));
+
+		const Clock::time_point start = Clock::now();
+		for (int64_t index = chunkBegin; index < chunkEnd; index++) {
+			body(index);
+		}
+		const Clock::duration took = Clock::now() - start;
+
+		if (took < targetChunkTime / 2 && state.grain <= maxGrain / 2) {
+			state.grain *= 2;
+		} else if (took > targetChunkTime * 2 && state.grain > 1) {
+			state.grain /= 2;
+		}
+		return chunkEnd - chunkBegin;
+	}
+
+	int getThreadCount() const { return threadCount; }
+
+private:
+	/// Owned by a single thread index, aligned so threads do not share cache lines
+	struct alignas(64) ThreadState {
+		int64_t grain = 1;
+	};
+
+	alignas(64) std::atomic<int64_t> next; ///< First index not claimed yet
+	const int64_t end;
+	const int threadCount;
+	const int64_t maxGrain;
+	std::unique_ptr<ThreadState[]> threads;
+};
+
+/// Executor calling @body(index, threadIndex) for every index in [begin, end), each step runs one claimed chunk
+/// Stops once the range is exhausted, the executor is retired after the last running chunk returns
+template <typename Fn>
+struct ParallelForExecutor : Executor {
+	ParallelForExecutor(std::unique_ptr<Task> taskToExecute, int64_t begin, int64_t end, Fn body, int64_t maxGrain = INT64_MAX)
+		: Executor(std::move(taskToExecute))
+		, range(begin, end, ThreadManager::GetInstance().getThreadCount(), maxGrain)
+		, body(std::move(body))
+	{
+		// the range has state for the thread count of the compute workers, also when run on the blocking pool
+		maxThreads = range.getThreadCount();
+	}
+
+	virtual ExecStatus ExecuteStep(int threadIndex, int) {
+		const int64_t processed = range.runChunk(threadIndex, [this, threadIndex](int64_t index) {
+			body(index, threadIndex);
+		});
+		return processed ? ES_Continue : ES_Stop;
+	}
+
+	ParallelRange range;
+	Fn body;
+};
+
+/// Executor folding every index in [begin, end) into a per thread value with @body(T &value, index), the thread
+/// finishing the last chunk combines all values with @combine(T &into, const T &from) and passes the result to @finish
+template <typename T, typename Fn, typename Combine>
+struct ParallelReduceExecutor : Executor {
+	ParallelReduceExecutor(std::unique_ptr<Task> taskToExecute, int64_t begin, int64_t end, T identity, Fn body, Combine combine,
+		std::function<void(T)> finish, int64_t maxGrain = INT64_MAX)
+		: Executor(std::move(taskToExecute))
+		, range(begin, end, ThreadManager::GetInstance().getThreadCount(), maxGrain)
+		, total(end - begin)
+		, identity(identity)
+		, partials(new Partial[ThreadManager::GetInstance().getThreadCount()])
+		, partialCount(ThreadManager::GetInstance().getThreadCount())
+		, body(std::move(body))
+		, combine(std::move(combine))
+		, finish(std::move(finish))
+	{
+		for (int c = 0; c < partialCount; c++) {
+			partials[c].value = identity;
+		}
+		maxThreads = partialCount;
+	}
+
+	virtual ExecStatus ExecuteStep(int threadIndex, int) {
+		T &value = partials[threadIndex].value;
+		const int64_t processed = range.runChunk(threadIndex, [this, &value](int64_t index) {
+			body(value, index);
+		});
+
+		// the partial values are complete once all indices are counted, acq_rel makes the last one see all writes
+		const bool last = processed ? completed.fetch_add(processed, std::memory_order_acq_rel) + processed == total :
+			total == 0 && !emptyReduced.exchange(true);
+		if (last) {
+			T result = identity;
+			for (int c = 0; c < partialCount; c++) {
+				combine(result, partials[c].value);
+			}
+			if (finish) {
+				finish(std::move(result));
+			}
+			return ES_Stop;
+		}
+		return processed ? ES_Continue : ES_Stop;
+	}
+
+	/// Value of a single thread index, aligned so threads do not share cache lines
+	struct alignas(64) Partial {
+		T value;
+	};
+
+	ParallelRange range;
+	const int64_t total;
+	const T identity;
+	std::atomic<int64_t> completed = 0; ///< Number of indices already folded into the partial values
+	std::atomic<bool> emptyReduced = false; ///< Makes sure an empty range still calls @finish exactly once
+	std::unique_ptr<Partial[]> partials; ///< One for each thread index
+	const int partialCount;
+	Fn body;
+	Combine combine;
+	std::function<void(T)> finish;
+};
+
+/// Create a ParallelForExecutor, the type of the body is deduced
+template <typename Fn>
+Executor *MakeParallelFor(std::unique_ptr<Task> task, int64_t begin, int64_t end, Fn body, int64_t maxGrain = INT64_MAX) {
+	return new ParallelForExecutor<Fn>(std::move(task), begin, end, std::move(body), maxGrain);
+}
+
+/// Create a ParallelReduceExecutor, the types of the body and the combine function are deduced
+template <typename T, typename Fn, typename Combine>
+Executor *MakeParallelReduce(std::unique_ptr<Task> task, int64_t begin, int64_t end, T identity, Fn body, Combine combine,
+	std::function<void(T)> finish, int64_t maxGrain = INT64_MAX) {
+	return new ParallelReduceExecutor<T, Fn, Combine>(std::move(task), begin, end, std::move(identity), std::move(body),
+		std::move(combine), std::move(finish), maxGrain);
+}
+
+};
@@ -1,24 +1,17 @@
 #include "Task.h"
 
-#include <chrono>
-#include <climits>
-#include <random>
+#include <atomic>
 
 namespace TaskSystem {
 
-TaskID::TaskID() {
-    std::random_device rd;
-    std::mt19937_64 rng;
-    
-    rng.seed(rd());
-    
-    auto now = std::chrono::system_clock::now();
-    auto timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+static std::atomic<uint64_t> nextID = 1;
 
-    std::uniform_int_distribution<unsigned long> distribution(0, ULONG_MAX);
-    unsigned long randomNum = distribution(rng);
+TaskID::TaskID() {
+    m_uniqueID = nextID.fetch_add(1, std::memory_order_relaxed);
+}
 
-    m_uniqueID = (timestamp << 32) | randomNum;
+uint64_t TaskID::Next() {
+    return nextID.load(std::memory_order_relaxed);
 }
 
 };
@@ -1,29 +1,50 @@
 #pragma once
 
 #include <string>
+#include <chrono>
 #include <memory>
 #include <ostream>
 #include <optional>
 #include <functional>
+#include "ObjectPool.h"
+#include "TaskParams.h"
 
 namespace TaskSystem {
 
+/// Unique for the lifetime of the process, taken from a global counter
 struct TaskID {
     TaskID();
     inline const uint64_t get() const { return m_uniqueID; }
+    /// The value the next TaskID gets, all values below it were handed out already
+    static uint64_t Next();
 private:
     uint64_t m_uniqueID;
 };
 
 struct PriorityComparator;
 
-struct Task {
+struct Task : PoolAllocated {
+    virtual ~Task() {}
+
+    /// Named lookups, ScheduleTask calls them once for each parameter in the schema of the executor
+    /// and stores the results in the block returned by GetParams, executors should read that instead
     virtual std::optional<int>         GetIntParam(const std::string &name)     const { return std::nullopt; }
     virtual std::optional<std::string> GetStringParam(const std::string &name)  const { return std::nullopt; }
     virtual std::optional<double>      GetDoubleParam(const std::string &name)  const { return std::nullopt; }
     virtual std::optional<void*>       GetAnyParam(const std::string &name)     const { return std::nullopt; }
     virtual std::string                GetExecutorName() const = 0;
 
+    /// Priority the task was scheduled with, valid once ScheduleTask was called
+    inline int GetPriority() const { return m_priority; }
+
+    /// Time the task has to be finished by, no step is started after it and the task ends as TS_Expired
+    /// Must be set before ScheduleTask, tasks without a deadline run until they finish
+    inline void SetDeadline(std::chrono::steady_clock::time_point deadline) { m_deadline = deadline; }
+    inline std::chrono::steady_clock::time_point GetDeadline() const { return m_deadline; }
+
+    /// Parameters resolved against the schema the executor declared at Register, valid once ScheduleTask was called
+    inline const ParamBlock &GetParams() const { return m_params; }
+
     inline bool operator< (const Task& other) const { return m_priority <  other.m_priority; }
     inline bool operator> (const Task& other) const { return m_priority >  other.m_priority; }
     inline bool operator==(const Task& other) const { return m_priority == other.m_priority; }
@@ -34,8 +55,29 @@ struct Task {
     }
     friend struct PriorityComparator;
     friend class TaskSystemExecutor;
+protected:
+    ParamBlock m_params; ///< Filled by ScheduleTask unless the task already bound it to the schema
 private:
     int32_t m_priority;
+    std::chrono::steady_clock::time_point m_deadline = std::chrono::steady_clock::time_point::max();
+};
+
+/// Task that only carries a parameter block, filled through the slots of the schema
+/// Building it takes no virtual calls or name lookups, see TaskSystemExecutor::MakeTask
+struct ParamTask : Task {
+    explicit ParamTask(const ParamSchema &schema) : m_schema(&schema) {
+        m_params = ParamBlock(schema);
+    }
+
+    template <typename T, typename V>
+    ParamTask &Set(ParamSlot<T> slot, V &&value) {
+        m_params.Set(slot, T(std::forward<V>(value)));
+        return *this;
+    }
+
+    virtual std::string GetExecutorName() const { return m_schema->GetExecutorName(); }
+private:
+    const ParamSchema *m_schema;
 };
 
 struct PriorityComparator {
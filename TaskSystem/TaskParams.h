@@ -0,0 +1,149 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#include <optional>
+
+namespace TaskSystem {
+
+enum class ParamType : uint8_t {
+    PT_Int, PT_Double, PT_String, PT_Any,
+};
+
+/// Maps the C++ type of a parameter to its ParamType
+template <typename T> struct ParamTypeOf;
+template <> struct ParamTypeOf<int> { static constexpr ParamType value = ParamType::PT_Int; };
+template <> struct ParamTypeOf<double> { static constexpr ParamType value = ParamType::PT_Double; };
+template <> struct ParamTypeOf<std::string> { static constexpr ParamType value = ParamType::PT_String; };
+template <> struct ParamTypeOf<void *> { static constexpr ParamType value = ParamType::PT_Any; };
+
+/// Index of a parameter in the blocks of one schema, the type is checked at compile time
+template <typename T>
+struct ParamSlot {
+    int index = -1;
+    bool IsValid() const { return index >= 0; }
+};
+
+/// Parameters an executor reads from its tasks, declared once at TaskSystemExecutor::Register
+/// Each parameter gets a slot index, executors keep the slots and read parameters without looking up names
+class ParamSchema {
+public:
+    /// Maximum number of parameters, the set parameters of a block fit in a single mask
+    static constexpr int maxParams = 64;
+
+    struct Param {
+        std::string name;
+        ParamType type;
+        bool required = false; ///< Scheduling a task that does not set it fails
+    };
+
+    /// Declare a parameter, names must be unique within the schema
+    /// @return the slot to read and write the parameter with
+    template <typename T>
+    ParamSlot<T> Add(const std::string &name, bool required = false) {
+        assert(int(params.size()) < maxParams && "Too many parameters");
+        assert(Find(name) == -1 && "Parameter declared twice");
+        params.push_back(Param{name, ParamTypeOf<T>::value, required});
+        return ParamSlot<T>{int(params.size()) - 1};
+    }
+
+    /// @return the slot index of the parameter, -1 if it is not declared
+    int Find(const std::string &name) const {
+        for (int c = 0; c < int(params.size()); c++) {
+            if (params[c].name == name) {
+                return c;
+            }
+        }
+        return -1;
+    }
+
+    int Size() const { return int(params.size()); }
+    const Param &Get(int index) const { return params[index]; }
+
+    /// Name the schema was registered with, empty until Register is called
+    const std::string &GetExecutorName() const { return executorName; }
+
+private:
+    friend class TaskSystemExecutor;
+    std::string executorName;
+    std::vector<Param> params;
+};
+
+/// Values of all parameters of one task, stored in a flat array indexed with the slots of the schema
+/// Numbers and pointers are stored inline, strings in a separate array so the values stay 8 bytes each
+class ParamBlock {
+    union Value {
+        int64_t i;
+        double d;
+        void *p;
+    };
+public:
+    /// Unbound block, it does not hold any parameters
+    ParamBlock() = default;
+
+    explicit ParamBlock(const ParamSchema &schema)
+        : schema(&schema)
+        , values(schema.Size() ? new Value[schema.Size()] : nullptr)
+    {}
+
+    ParamBlock(ParamBlock &&) = default;
+    ParamBlock &operator=(ParamBlock &&) = default;
+
+    /// Check if the block was created for @other
+    bool IsBoundTo(const ParamSchema &other) const { return schema == &other; }
+
+    bool Has(int index) const { return (setMask >> index) & 1; }
+
+    /// Set the value in @slot, the slot must come from the schema the block was created with
+    void Set(ParamSlot<int> slot, int value) { at(slot.index).i = value; }
+    void Set(ParamSlot<double> slot, double value) { at(slot.index).d = value; }
+    void Set(ParamSlot<void *> slot, void *value) { at(slot.index).p = value; }
+    void Set(ParamSlot<std::string> slot, std::string value) {
+        const bool replace = has(slot.index);
+        Value &stored = at(slot.index);
+        if (replace) {
+            strings[stored.i] = std::move(value);
+        } else {
+            stored.i = int64_t(strings.size());
+            strings.push_back(std::move(value));
+        }
+    }
+
+    /// @return the value in @slot, empty if it was not set
+    std::optional<int> Get(ParamSlot<int> slot) const {
+        return has(slot.index) ? std::optional<int>(int(values[slot.index].i)) : std::nullopt;
+    }
+    std::optional<double> Get(ParamSlot<double> slot) const {
+        return has(slot.index) ? std::optional<double>(values[slot.index].d) : std::nullopt;
+    }
+    std::optional<void *> Get(ParamSlot<void *> slot) const {
+        return has(slot.index) ? std::optional<void *>(values[slot.index].p) : std::nullopt;
+    }
+    /// The string is owned by the block, nullptr if it was not set
+    const std::string *Get(ParamSlot<std::string> slot) const {
+        return has(slot.index) ? &strings[values[slot.index].i] : nullptr;
+    }
+
+private:
+    bool has(int index) const {
+        assert(schema && index >= 0 && index < schema->Size() && "Slot is not from the schema of the block");
+        return Has(index);
+    }
+
+    Value &at(int index) {
+        assert(schema && index >= 0 && index < schema->Size() && "Slot is not from the schema of the block");
+        setMask |= uint64_t(1) << index;
+        return values[index];
+    }
+
+    const ParamSchema *schema = nullptr;
+    std::unique_ptr<Value[]> values;
+    uint64_t setMask = 0; ///< Bit for each slot that has a value
+    std::vector<std::string> strings; ///< Values of the string parameters, indexed by Value::i
+};
+
+};
@@ -1,5 +1,9 @@
 #include "TaskSystem.h"
+#include "Async.h"
 #include <cassert>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
 #if defined(_WIN32) || defined(_WIN64)
 #define USE_WIN
 #define WIN32_LEAN_AND_MEAN
@@ -11,9 +15,25 @@
 
 namespace TaskSystem {
 
-TaskSystemExecutor::TaskSystemExecutor(int threadCount)
-: tm(ThreadManager::GetInstance())
-, m_priority_queue(PriorityComparator()) {}
+TaskSystemExecutor::TaskSystemExecutor()
+: m_constructors(new std::atomic<ExecutorConstructor>[maxExecutorTypes])
+, m_schemas(new ParamSchema[maxExecutorTypes])
+, m_classes(new ExecutorClass[maxExecutorTypes])
+, m_pluginOf(new int[maxExecutorTypes])
+, tm(ThreadManager::GetInstance())
+, blocking(ThreadManager::GetBlockingInstance())
+, m_finished(new FinishedTask[finishedHistory]) {
+    std::fill(m_pluginOf.get(), m_pluginOf.get() + maxExecutorTypes, -1);
+    tm.start();
+    blocking.start();
+}
+
+TaskSystemExecutor::~TaskSystemExecutor() {
+    // let running executors finish, they call back into this object when retired
+    // compute executors can still hand work such as snapshots to the blocking pool, it stops last
+    tm.stop();
+    blocking.stop();
+}
 
 TaskSystemExecutor* TaskSystemExecutor::self = nullptr;
 
@@ -21,17 +41,22 @@ TaskSystemExecutor &TaskSystemExecutor::GetInstance() {
     return *self;
 }
 
-void TaskSystemExecutor::Init(int threadCount) {
+void TaskSystemExecutor::Init(int threadCount, int blockingThreads) {
+    Init(ThreadPlacement::Unpinned(threadCount), blockingThreads);
+}
+
+void TaskSystemExecutor::Init(const ThreadPlacement &placement, int blockingThreads) {
     delete self;
-    ThreadManager::Init(threadCount);
-    self = new TaskSystemExecutor(threadCount);
+    ThreadManager::Init(placement, blockingThreads);
+    self = new TaskSystemExecutor();
 }
 
 bool TaskSystemExecutor::LoadLibrary(const std::string &path) {
 #ifdef USE_WIN
     HMODULE handle = LoadLibraryA(path.c_str());
 #else
-    void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    // symbols are bound on first call, executors that are never used cost nothing at load time
+    void *handle = dlopen(path.c_str(), RTLD_LAZY | RTLD_LOCAL);
     if (handle == nullptr) {
         const char* error = dlerror();
         printf("the error is %s\n", error);
@@ -55,27 +80,537 @@ bool TaskSystemExecutor::LoadLibrary(const std::string &path) {
     return false;
 }
 
+int TaskSystemExecutor::ScanPlugins(const std::string &directory) {
+    std::error_code error;
+    std::filesystem::directory_iterator it(directory, error);
+    if (error) {
+        return 0;
+    }
+
+    int found = 0;
+    for (const std::filesystem::directory_entry &entry : it) {
+        const std::filesystem::path &manifest = entry.path();
+        if (manifest.extension() != ".executors") {
+            continue;
+        }
+        // the manifest is named after the library file, only its extension is added
+        const std::filesystem::path library = std::filesystem::path(manifest).replace_extension();
+        if (!std::filesystem::exists(library, error)) {
+            printf("Library [%s] listed by [%s] not found\n", library.string().c_str(), manifest.string().c_str());
+            continue;
+        }
+
+        m_plugins.emplace_back(new Plugin(library.string()));
+        const int plugin = int(m_plugins.size()) - 1;
+        std::ifstream file(manifest);
+        std::string name;
+        while (std::getline(file, name)) {
+            name.erase(std::find_if(name.rbegin(), name.rend(), [](char c) { return !isspace((unsigned char)c); }).base(), name.end());
+            if (name.empty() || FindExecutorType(name).IsValid()) {
+                continue;
+            }
+            m_pluginOf[addExecutorType(name).index] = plugin;
+            found++;
+        }
+    }
+    return found;
+}
+
+void TaskSystemExecutor::PrewarmPlugins() {
+    for (const std::unique_ptr<Plugin> &plugin : m_plugins) {
+        RunBlocking([this, library = plugin.get()]() {
+            loadPlugin(*library);
+        });
+    }
+}
+
+void TaskSystemExecutor::loadPlugin(ExecutorType type) {
+    const int plugin = m_pluginOf[type.index];
+    if (plugin < 0) {
+        return;
+    }
+    loadPlugin(*m_plugins[plugin]);
+    if (!m_constructors[type.index].load(std::memory_order_acquire)) {
+        printf("Executor [%s] is not registered by [%s]\n", m_schemas[type.index].GetExecutorName().c_str(), m_plugins[plugin]->path.c_str());
+    }
+}
+
+void TaskSystemExecutor::loadPlugin(Plugin &plugin) {
+    // the first caller loads it, the others wait for it, a failed load is not retried
+    std::call_once(plugin.loaded, [this, &plugin]() {
+        LoadLibrary(plugin.path);
+    });
+}
+
+
+int TaskGraph::Add(std::unique_ptr<Task> task, int priority, std::vector<int> after, int weight) {
+    for (int index : after) {
+        assert(index >= 0 && index < int(m_nodes.size()) && "Nodes can only depend on nodes added before them");
+    }
+    m_nodes.push_back(Node{std::move(task), priority, weight, std::move(after)});
+    return int(m_nodes.size()) - 1;
+}
+
+TaskID TaskSystemExecutor::ScheduleTask(std::unique_ptr<Task> task, int priority, int weight) {
+    const ExecutorType type = FindExecutorType(task->GetExecutorName());
+    return ScheduleTask(type, std::move(task), priority, std::span<const TaskID>(), weight);
+}
+
+TaskID TaskSystemExecutor::ScheduleTask(std::unique_ptr<Task> task, int priority, std::span<const TaskID> predecessors, int weight) {
+    const ExecutorType type = FindExecutorType(task->GetExecutorName());
+    return ScheduleTask(type, std::move(task), priority, predecessors, weight);
+}
+
+TaskID TaskSystemExecutor::ScheduleTask(ExecutorType type, std::unique_ptr<Task> task, int priority, int weight) {
+    return ScheduleTask(type, std::move(task), priority, std::span<const TaskID>(), weight);
+}
+
+TaskID TaskSystemExecutor::ScheduleTask(ExecutorType type, std::unique_ptr<Task> task, int priority, std::span<const TaskID> predecessors, int weight) {
+    assert(type.IsValid() && type.index < m_executorTypeCount && "Executor not registered");
+    if (!m_constructors[type.index].load(std::memory_order_acquire)) {
+        // found by ScanPlugins, this is the first task for it
+        loadPlugin(type);
+        assert(m_constructors[type.index].load() && "Executor not registered");
+    }
+    resolveParams(type, *task);
+
+    const TaskID id;
+    {
+        std::lock_guard<std::mutex> lock(m_tasksMtx);
+        TaskRecord &record = m_tasks[id.get()];
+        for (const TaskID &predecessor : predecessors) {
+            auto it = m_tasks.find(predecessor.get());
+            if (it != m_tasks.end() && !isDone(it->second.state)) {
+                it->second.successors.push_back(id);
+                record.predecessors++;
+            }
+        }
+
+        if (record.predecessors > 0) {
+            record.state = TaskState::TS_Waiting;
+            record.type = type;
+            record.pending = std::move(task);
+            record.priority = priority;
+            record.weight = weight;
+            return id;
+        }
+    }
+
+    submit(id, type, std::move(task), priority, weight);
+    return id;
+}
+
+std::vector<TaskID> TaskSystemExecutor::ScheduleGraph(TaskGraph &&graph) {
+    std::vector<TaskID> ids;
+    ids.reserve(graph.m_nodes.size());
+    for (TaskGraph::Node &node : graph.m_nodes) {
+        std::vector<TaskID> predecessors;
+        for (int index : node.after) {
+            predecessors.push_back(ids[index]);
+        }
+        ids.push_back(ScheduleTask(std::move(node.task), node.priority, predecessors, node.weight));
+    }
+    graph.m_nodes.clear();
+    return ids;
+}
+
+void TaskSystemExecutor::resolveParams(ExecutorType type, Task &task) const {
+    const ParamSchema &schema = m_schemas[type.index];
+    if (!task.m_params.IsBoundTo(schema)) {
+        ParamBlock params(schema);
+        for (int c = 0; c < schema.Size(); c++) {
+            const ParamSchema::Param &param = schema.Get(c);
+            switch (param.type) {
+            case ParamType::PT_Int:
+                if (const std::optional<int> value = task.GetIntParam(param.name)) {
+                    params.Set(ParamSlot<int>{c}, *value);
+                }
+                break;
+            case ParamType::PT_Double:
+                if (const std::optional<double> value = task.GetDoubleParam(param.name)) {
+                    params.Set(ParamSlot<double>{c}, *value);
+                }
+                break;
+            case ParamType::PT_String:
+                if (std::optional<std::string> value = task.GetStringParam(param.name)) {
+                    params.Set(ParamSlot<std::string>{c}, std::move(*value));
+                }
+                break;
+            case ParamType::PT_Any:
+                if (const std::optional<void *> value = task.GetAnyParam(param.name)) {
+                    params.Set(ParamSlot<void *>{c}, *value);
+                }
+                break;
+            }
+        }
+        task.m_params = std::move(params);
+    }
 
-TaskID TaskSystemExecutor::ScheduleTask(std::unique_ptr<Task> task, int priority) {
+    for (int c = 0; c < schema.Size(); c++) {
+        if (schema.Get(c).required && !task.m_params.Has(c)) {
+            printf("Task for [%s] is missing required parameter [%s]\n", schema.GetExecutorName().c_str(), schema.Get(c).name.c_str());
+            assert(false && "Missing required parameter");
+        }
+    }
+}
+
+void TaskSystemExecutor::submit(TaskID id, ExecutorType type, std::unique_ptr<Task> task, int priority, int weight) {
     task->m_priority = priority;
-    std::unique_ptr<Executor> exec(m_executors[task->GetExecutorName()](std::move(task)));
-    m_priority_queue.emplace(task.get());
+    const std::chrono::steady_clock::time_point deadline = task->m_deadline;
+    if (deadline != std::chrono::steady_clock::time_point::max() && deadline <= std::chrono::steady_clock::now()) {
+        // expired while waiting for its predecessors, or scheduled too late, the executor is never created
+        task.reset();
+        Completion completion;
+        {
+            std::lock_guard<std::mutex> lock(m_tasksMtx);
+            unlockedFinish(id, TaskState::TS_Expired, completion);
+        }
+        complete(id, completion);
+        return;
+    }
+
+    const ExecutorConstructor constructor = m_constructors[type.index].load(std::memory_order_acquire);
+    Executor *exec = constructor(std::move(task));
+    exec->deadline = deadline;
+#ifdef TS_ENABLE_TRACING
+    exec->traceId = id.get();
+    // the schema is replaced if the name is registered again, the trace keeps its own copy
+    exec->traceName = Trace::Intern(m_schemas[type.index].GetExecutorName());
+#endif
+
+    ThreadManager &pool = m_classes[type.index] == EC_Blocking ? blocking : tm;
+    pool.runThreadsNoWait(*exec, priority, weight, [this, exec, id]() {
+        onExecutorFinished(id, exec);
+    });
+
+    // published only once scheduled, the executor could already be retired and deleted
+    bool cancel = false;
+    {
+        std::lock_guard<std::mutex> lock(m_tasksMtx);
+        // the record is gone if the task already finished
+        auto it = m_tasks.find(id.get());
+        if (it != m_tasks.end() && it->second.state == TaskState::TS_Scheduled) {
+            TaskRecord &record = it->second;
+            record.executor = exec;
+            if (record.cancelled) {
+                record.cancelling++;
+                cancel = true;
+            }
+        }
+    }
+    if (cancel) {
+        cancelExecutor(id, exec);
+    }
+}
+
+void TaskSystemExecutor::onExecutorFinished(TaskID task, Executor *executor) {
+    TaskState state = TaskState::TS_Finished;
+    switch (executor->GetStopReason()) {
+    case Executor::SR_Stopped: state = TaskState::TS_Finished; break;
+    case Executor::SR_Cancelled: state = TaskState::TS_Cancelled; break;
+    case Executor::SR_Expired: state = TaskState::TS_Expired; break;
+    }
+
+    Completion completion;
+    bool owned = true;
+    {
+        std::lock_guard<std::mutex> lock(m_tasksMtx);
+        TaskRecord &record = m_tasks[task.get()];
+        record.executor = nullptr;
+        // a CancelTask still using the executor deletes it once it is done
+        owned = record.cancelling == 0;
+        unlockedFinish(task, state, completion);
+    }
+    if (owned) {
+        delete executor;
+    }
+    complete(task, completion);
+}
+
+void TaskSystemExecutor::cancelExecutor(TaskID task, Executor *executor) {
+    // forwarded to the pool the executor runs on
+    tm.cancel(*executor);
+
+    bool retired = false;
+    {
+        std::lock_guard<std::mutex> lock(m_tasksMtx);
+        auto it = m_tasks.find(task.get());
+        TaskRecord &record = it->second;
+        retired = --record.cancelling == 0 && !record.executor;
+        // the record was kept for this call once the task finished
+        if (record.cancelling == 0 && isDone(record.state)) {
+            m_tasks.erase(it);
+        }
+    }
+    if (retired) {
+        delete executor;
+    }
+}
+
+void TaskSystemExecutor::CancelTask(TaskID task) {
+    Completion completion;
+    std::unique_ptr<Task> dropped;
+    Executor *executor = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_tasksMtx);
+        auto it = m_tasks.find(task.get());
+        if (it == m_tasks.end() || isDone(it->second.state)) {
+            return;
+        }
+
+        TaskRecord &record = it->second;
+        if (record.state == TaskState::TS_Waiting) {
+            dropped = std::move(record.pending);
+            unlockedFinish(task, TaskState::TS_Cancelled, completion);
+        } else if (!record.executor) {
+            // the executor is being created, submit cancels it once it is scheduled
+            record.cancelled = true;
+            return;
+        } else {
+            executor = record.executor;
+            record.cancelling++;
+        }
+    }
+
+    if (executor) {
+        cancelExecutor(task, executor);
+        return;
+    }
+    dropped.reset();
+    complete(task, completion);
+}
+
+void TaskSystemExecutor::unlockedFinish(TaskID task, TaskState state, Completion &completion) {
+    auto it = m_tasks.find(task.get());
+    TaskRecord &record = it->second;
+    record.state = state;
+    FinishedTask &finished = m_finished[task.get() % finishedHistory];
+    finished.id = task.get();
+    finished.state = state;
+    finished.finishTime = std::chrono::steady_clock::now();
+    completion.state = state;
+    completion.callbacks.swap(record.callbacks);
+
+    for (const TaskID &successor : record.successors) {
+        // cancelled successors stay in the list, they are already done and their records can be gone
+        auto waitingIt = m_tasks.find(successor.get());
+        if (waitingIt == m_tasks.end()) {
+            continue;
+        }
+        TaskRecord &waiting = waitingIt->second;
+        if (--waiting.predecessors == 0 && waiting.state == TaskState::TS_Waiting) {
+            waiting.state = TaskState::TS_Scheduled;
+            completion.ready.push_back(ReadyTask{successor, waiting.type, std::move(waiting.pending), waiting.priority, waiting.weight});
+        }
+    }
+    record.successors.clear();
+
+    for (Waiter *waiter : record.waiters) {
+        // WaitForAny waiters stay registered in other records until they wake up, never go below 0
+        if (waiter->remaining > 0 && --waiter->remaining == 0) {
+            if (waiter->worker >= 0) {
+                waiter->done.store(true);
+                completion.helpers.emplace_back(waiter->pool, waiter->worker);
+            } else {
+                waiter->event.notify_one();
+            }
+        }
+    }
+    record.waiters.clear();
 
-    while (exec->ExecuteStep(0, 1) != Executor::ExecStatus::ES_Stop)
-        ;
+    // a CancelTask still using the executor removes it once it is done
+    if (record.cancelling == 0) {
+        m_tasks.erase(it);
+    }
+}
+
+void TaskSystemExecutor::complete(TaskID task, Completion &completion) {
+    // the waiters can be gone already, only their workers are touched
+    for (const std::pair<ThreadManager *, int> &helper : completion.helpers) {
+        helper.first->wakeWorker(helper.second);
+    }
+
+    // successors are released from this worker, before the callbacks so the other workers pick them up sooner
+    for (ReadyTask &successor : completion.ready) {
+        submit(successor.id, successor.type, std::move(successor.task), successor.priority, successor.weight);
+    }
+
+    // callbacks are free to call back into the task system
+    for (Callback &callback : completion.callbacks) {
+        callback(task, completion.state);
+    }
+}
 
-    return TaskID{};
+void TaskSystemExecutor::unlockedAddWaiter(std::span<const TaskID> tasks, Waiter &waiter) {
+    for (const TaskID &task : tasks) {
+        auto it = m_tasks.find(task.get());
+        if (it != m_tasks.end() && !isDone(it->second.state)) {
+            it->second.waiters.push_back(&waiter);
+            waiter.remaining++;
+        }
+    }
 }
 
 void TaskSystemExecutor::WaitForTask(TaskID task) {
-    return;
+    WaitForAll(std::span<const TaskID>(&task, 1));
+}
+
+void TaskSystemExecutor::setWaitingWorker(Waiter &waiter) {
+    for (ThreadManager *pool : {&tm, &blocking}) {
+        waiter.worker = pool->getCurrentThreadIndex();
+        if (waiter.worker >= 0) {
+            waiter.pool = pool;
+            return;
+        }
+    }
+}
+
+void TaskSystemExecutor::wait(std::unique_lock<std::mutex> &lock, Waiter &waiter) {
+    if (waiter.worker < 0) {
+        waiter.event.wait(lock, [&waiter]() {
+            return waiter.remaining == 0;
+        });
+        return;
+    }
+    if (waiter.remaining == 0) {
+        return;
+    }
+
+    // joining from inside a step, the worker runs other tasks, likely the awaited ones, instead of blocking
+    lock.unlock();
+    waiter.pool->helpUntil(waiter.worker, [&waiter]() {
+        return waiter.done.load();
+    });
+    lock.lock();
+}
+
+void TaskSystemExecutor::WaitForAll(std::span<const TaskID> tasks) {
+    Waiter waiter;
+    setWaitingWorker(waiter);
+    std::unique_lock<std::mutex> lock(m_tasksMtx);
+    unlockedAddWaiter(tasks, waiter);
+    wait(lock, waiter);
+}
+
+TaskID TaskSystemExecutor::WaitForAny(std::span<const TaskID> tasks) {
+    assert(!tasks.empty() && "Nothing to wait for");
+    Waiter waiter;
+    setWaitingWorker(waiter);
+    std::unique_lock<std::mutex> lock(m_tasksMtx);
+    unlockedAddWaiter(tasks, waiter);
+
+    // a single finished task is enough, and if one was already finished no waiters were needed
+    if (waiter.remaining == int(tasks.size())) {
+        waiter.remaining = 1;
+        wait(lock, waiter);
+    }
+
+    std::optional<TaskID> finished;
+    for (const TaskID &task : tasks) {
+        auto it = m_tasks.find(task.get());
+        if (it == m_tasks.end() || isDone(it->second.state)) {
+            if (!finished) {
+                finished = task;
+            }
+        } else {
+            std::vector<Waiter *> &waiters = it->second.waiters;
+            waiters.erase(std::remove(waiters.begin(), waiters.end(), &waiter), waiters.end());
+        }
+    }
+    return *finished;
 }
 
 void TaskSystemExecutor::OnTaskCompleted(TaskID task, std::function<void(TaskID)> &&callback) {
-    callback(task);
+    OnTaskCompleted(task, [callback = std::move(callback)](TaskID id, TaskState) {
+        callback(id);
+    });
+}
+
+void TaskSystemExecutor::OnTaskCompleted(TaskID task, std::function<void(TaskID, TaskState)> &&callback) {
+    TaskState state = TaskState::TS_Finished;
+    {
+        std::lock_guard<std::mutex> lock(m_tasksMtx);
+        auto it = m_tasks.find(task.get());
+        if (it != m_tasks.end() && !isDone(it->second.state)) {
+            it->second.callbacks.push_back(std::move(callback));
+            return;
+        }
+        if (it != m_tasks.end()) {
+            state = it->second.state;
+        } else if (m_finished[task.get() % finishedHistory].id == task.get()) {
+            state = m_finished[task.get() % finishedHistory].state;
+        }
+    }
+    callback(task, state);
+}
+
+TaskState TaskSystemExecutor::GetTaskState(TaskID task) {
+    std::lock_guard<std::mutex> lock(m_tasksMtx);
+    auto it = m_tasks.find(task.get());
+    if (it != m_tasks.end()) {
+        return it->second.state;
+    }
+    const FinishedTask &finished = m_finished[task.get() % finishedHistory];
+    if (finished.id == task.get()) {
+        return finished.state;
+    }
+    // ids are handed out in order, one that was handed out and has no record finished long ago
+    return task.get() < TaskID::Next() ? TaskState::TS_Finished : TaskState::TS_Unknown;
+}
+
+void TaskSystemExecutor::SetSchedulingPolicy(SchedulingPolicy policy) {
+    tm.setSchedulingPolicy(policy);
+    blocking.setSchedulingPolicy(policy);
+}
+
+std::optional<std::chrono::steady_clock::time_point> TaskSystemExecutor::GetTaskFinishTime(TaskID task) {
+    std::lock_guard<std::mutex> lock(m_tasksMtx);
+    const FinishedTask &finished = m_finished[task.get() % finishedHistory];
+    if (finished.id != task.get()) {
+        return std::nullopt;
+    }
+    return finished.finishTime;
+}
+
+ExecutorType TaskSystemExecutor::Register(const std::string &executorName, ExecutorConstructor constructor, ParamSchema schema,
+    ExecutorClass executorClass) {
+    const ExecutorType type = addExecutorType(executorName);
+    schema.executorName = executorName;
+    // assigned in place, tasks and blocks keep pointing at the same schema object
+    m_schemas[type.index] = std::move(schema);
+    m_classes[type.index] = executorClass;
+    m_constructors[type.index].store(constructor, std::memory_order_release);
+    return type;
 }
-void TaskSystemExecutor::Register(const std::string &executorName, ExecutorConstructor constructor) {
-    m_executors[executorName] = constructor;
+
+ExecutorType TaskSystemExecutor::addExecutorType(const std::string &executorName) {
+    std::unique_lock<std::shared_mutex> lock(m_executorsMtx);
+    ExecutorType &type = m_executors[executorName];
+    if (!type.IsValid()) {
+        assert(m_executorTypeCount < maxExecutorTypes && "Too many executors registered");
+        type.index = m_executorTypeCount++;
+        // named before the library registers it, for the messages about it
+        m_schemas[type.index].executorName = executorName;
+    }
+    return type;
+}
+
+const ParamSchema &TaskSystemExecutor::GetSchema(ExecutorType type) {
+    assert(type.IsValid() && type.index < m_executorTypeCount && "Executor not registered");
+    if (!m_constructors[type.index].load(std::memory_order_acquire)) {
+        loadPlugin(type);
+    }
+    return m_schemas[type.index];
+}
+
+std::unique_ptr<ParamTask> TaskSystemExecutor::MakeTask(ExecutorType type) {
+    return std::make_unique<ParamTask>(GetSchema(type));
+}
+
+ExecutorType TaskSystemExecutor::FindExecutorType(const std::string &executorName) const {
+    std::shared_lock<std::shared_mutex> lock(m_executorsMtx);
+    auto it = m_executors.find(executorName);
+    return it == m_executors.end() ? ExecutorType() : it->second;
 }
 
 
@@ -3,33 +3,290 @@
 #include "Task.h"
 #include "Executor.h"
 #include <map>
+#include <atomic>
+#include <span>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <optional>
+#include <shared_mutex>
 #include <functional>
-#include <random>
-#include <queue>
+#include <unordered_map>
+#include <condition_variable>
 
 namespace TaskSystem {
 
 class ThreadManager;
 
+enum class TaskState {
+    TS_Unknown, ///< The TaskID was not handed out yet
+    TS_Waiting, ///< Waiting for its predecessors to finish, the executor is not created yet
+    TS_Scheduled, ///< Scheduled, some steps may have already run
+    TS_Finished, ///< The executor returned ES_Stop and was destroyed
+    TS_Cancelled, ///< Stopped by CancelTask before it finished, the executor was destroyed
+    TS_Expired, ///< Its deadline passed before it finished, the executor was destroyed or never created
+};
+
+/// Handle of a registered executor, resolved once so scheduling does not look up the name for each task
+struct ExecutorType {
+    int index = -1;
+    bool IsValid() const { return index >= 0; }
+};
+
+/// Tasks with dependencies between them, scheduled together with TaskSystemExecutor::ScheduleGraph
+/// Nodes can only depend on nodes added before them, so the graph can't have cycles
+class TaskGraph {
+public:
+    /// Add a task that starts once all nodes in @after are finished
+    /// @return index of the node, used in @after of later nodes and in the result of ScheduleGraph
+    int Add(std::unique_ptr<Task> task, int priority, std::vector<int> after = {}, int weight = 1);
+
+    int Size() const { return int(m_nodes.size()); }
+private:
+    friend class TaskSystemExecutor;
+    struct Node {
+        std::unique_ptr<Task> task;
+        int priority = 0;
+        int weight = 1;
+        std::vector<int> after;
+    };
+    std::vector<Node> m_nodes;
+};
+
 class TaskSystemExecutor {
-    TaskSystemExecutor(int threadCount);
+    TaskSystemExecutor();
 public:
+    ~TaskSystemExecutor();
     TaskSystemExecutor(const TaskSystemExecutor &) = delete;
     TaskSystemExecutor &operator=(const TaskSystemExecutor &) = delete;
 
-    static void Init(int threadCount);
+    /// Create the instance with @threadCount unpinned worker threads
+    /// @param blockingThreads - limit of the elastic pool running the EC_Blocking executors
+    static void Init(int threadCount, int blockingThreads = ThreadManager::defaultBlockingThreads);
+
+    /// Create the instance with worker threads placed on the CPUs by @placement, for example
+    /// ThreadPlacement::PerNode() to keep the workers of each NUMA node together
+    /// Workers that can't be pinned still run, ThreadManager::getUnpinnedCount tells how many
+    static void Init(const ThreadPlacement &placement, int blockingThreads = ThreadManager::defaultBlockingThreads);
     static TaskSystemExecutor &GetInstance();
 
+    /// Block until the task is finished, returns immediately for finished or unknown tasks
+    /// All of the WaitFor* functions can be called from inside ExecuteStep to join tasks spawned from the step:
+    /// the worker runs other executors until the tasks finish instead of blocking, see ThreadManager::helpUntil
+    /// Workers of the blocking pool, EC_Blocking executors and RunBlocking jobs, help with the blocking executors
     void WaitForTask(TaskID task);
-    TaskID ScheduleTask(std::unique_ptr<Task> task, int priority);
+
+    /// Block until all of the tasks are finished, the caller is woken up only once
+    void WaitForAll(std::span<const TaskID> tasks);
+
+    /// Block until at least one of the tasks is finished
+    /// @return the first task in @tasks that is finished
+    TaskID WaitForAny(std::span<const TaskID> tasks);
+
+    /// Schedule a task to run on the thread pool and return immediately
+    /// @param priority - tasks with higher priority take the threads from lower priority ones
+    /// @param weight - tasks with the same priority split the threads proportionally to their weight
+    /// The deadline of the task, see Task::SetDeadline, is passed to the executor
+    TaskID ScheduleTask(std::unique_ptr<Task> task, int priority, int weight = 1);
+
+    /// Schedule a task that starts once all of @predecessors are finished and return immediately
+    /// The executor is created and scheduled on the worker that finishes the last predecessor,
+    /// unknown and already finished predecessors are not waited for
+    TaskID ScheduleTask(std::unique_ptr<Task> task, int priority, std::span<const TaskID> predecessors, int weight = 1);
+
+    /// Same as the overloads above, without looking up the executor by the name of the task
+    /// @param type - handle returned by Register or FindExecutorType
+    TaskID ScheduleTask(ExecutorType type, std::unique_ptr<Task> task, int priority, int weight = 1);
+    TaskID ScheduleTask(ExecutorType type, std::unique_ptr<Task> task, int priority, std::span<const TaskID> predecessors, int weight = 1);
+
+    /// Schedule all tasks of the graph, each one starts once its predecessors in the graph are finished
+    /// @return the id of each node, in the order the nodes were added
+    std::vector<TaskID> ScheduleGraph(TaskGraph &&graph);
+
+    /// Stop the task, the executor is cancelled between steps, see ThreadManager::cancel, and destroyed as soon as
+    /// the steps running on it return. A task still waiting for its predecessors is dropped right away
+    /// The task ends as TS_Cancelled, unless it stopped by itself first. Its successors are started as with
+    /// any other finished task. Does nothing for unknown and already finished tasks
+    void CancelTask(TaskID task);
+
+    /// Register callback called once the task is finished, on the worker thread that finished it
+    /// If the task is already finished the callback is called immediately on the caller thread
+    /// Called for cancelled and expired tasks as well, use the overload below to tell them apart
     void OnTaskCompleted(TaskID task, std::function<void(TaskID)> &&callback);
+
+    /// Same as above, the callback also gets the state the task ended in: TS_Finished, TS_Cancelled or TS_Expired
+    void OnTaskCompleted(TaskID task, std::function<void(TaskID, TaskState)> &&callback);
+
+    /// Get the state of the task, a task that finished long ago, see @finishedHistory, is reported as TS_Finished
+    /// even if it was cancelled or expired
+    TaskState GetTaskState(TaskID task);
+
+    /// Order of the tasks with the same priority on both pools, see SchedulingPolicy
+    void SetSchedulingPolicy(SchedulingPolicy policy);
+
+    /// Get the time the task finished at, was cancelled at or expired at, empty if it is not finished yet
+    /// Only known for the last @finishedHistory tasks to finish, empty for older ones
+    std::optional<std::chrono::steady_clock::time_point> GetTaskFinishTime(TaskID task);
+
+    /// Load the library and register its executors right away, see ScanPlugins for loading it on first use
     bool LoadLibrary(const std::string &path);
-    void Register(const std::string &executorName, ExecutorConstructor constructor);
+
+    /// Find the executor libraries in @directory without loading them, from the manifest written next to each one
+    /// at build time: <library file>.executors with the name of each executor it registers, one per line.
+    /// The names can be used right away, the library is loaded by the first ScheduleTask, GetSchema or MakeTask
+    /// for any of them. Names that are already known are left as they are. Names the library registers that are
+    /// missing from its manifest are only known once something else loaded it.
+    /// Must not be called while tasks are being scheduled
+    /// @return number of executors found, 0 if the directory can't be read
+    int ScanPlugins(const std::string &directory);
+
+    /// Load the scanned libraries on the blocking pool and return immediately, so the first task of an executor
+    /// does not wait for its library. Tasks scheduled while a library is loading wait for that load
+    void PrewarmPlugins();
+
+    /// Register the constructor for tasks with @executorName, registering the same name again replaces it
+    /// Must not be called while tasks of the same executor are being scheduled, other names can be registered
+    /// at any time, as happens when a scanned library is loaded by its first task
+    /// @param schema - parameters the executor reads, registering the name again must declare the same ones
+    /// @param executorClass - EC_Blocking for executors that sleep or wait for I/O in their steps, they run on
+    ///                        a separate elastic pool and leave the compute workers to the CPU bound executors
+    /// @return handle for scheduling tasks of the executor without a name lookup
+    ExecutorType Register(const std::string &executorName, ExecutorConstructor constructor, ParamSchema schema = ParamSchema(),
+        ExecutorClass executorClass = EC_Compute);
+
+    /// Get the parameters declared at Register, the reference stays valid for the lifetime of the task system
+    /// Loads the library of a scanned executor
+    const ParamSchema &GetSchema(ExecutorType type);
+
+    /// Create a task for @type with an empty parameter block, fill it with ParamTask::Set
+    std::unique_ptr<ParamTask> MakeTask(ExecutorType type);
+
+    /// Get the handle of a registered executor, invalid handle if it is not registered
+    ExecutorType FindExecutorType(const std::string &executorName) const;
 private:
+    /// A thread blocked in one of the WaitFor* functions
+    struct Waiter {
+        int remaining = 0; ///< Number of tasks that still need to finish to wake the waiter
+        std::condition_variable event;
+        int worker = -1; ///< Thread index if the waiter is a worker helping while it waits, it is not using @event
+        ThreadManager *pool = nullptr; ///< Pool of @worker, the compute or the blocking one
+        std::atomic<bool> done = false; ///< Set with @remaining reaching 0, read by a helping worker without the lock
+    };
+
+    typedef std::function<void(TaskID, TaskState)> Callback;
+
+    /// Completion record of a task, removed once the task finished and no CancelTask is using its executor
+    struct TaskRecord {
+        TaskState state = TaskState::TS_Scheduled;
+        std::vector<Callback> callbacks; ///< Called once the task finishes
+        std::vector<Waiter *> waiters; ///< Threads parked on this task
+
+        Executor *executor = nullptr; ///< Executor of a TS_Scheduled task, set once it is scheduled, cleared once retired
+        int cancelling = 0; ///< CancelTask calls using @executor outside of the lock, the last one deletes a retired one
+        bool cancelled = false; ///< CancelTask came before @executor was set, cancelled once it is
+
+        std::unique_ptr<Task> pending; ///< Task of a TS_Waiting record, submitted once @predecessors reaches 0
+        ExecutorType type; ///< Executor, priority and weight @pending is submitted with
+        int priority = 0;
+        int weight = 1;
+        int predecessors = 0; ///< Number of unfinished tasks this one waits for
+        std::vector<TaskID> successors; ///< Waiting tasks to notify once this one finishes
+    };
+
+    /// Task whose predecessors just finished, taken out of its record to be submitted
+    struct ReadyTask {
+        TaskID id;
+        ExecutorType type;
+        std::unique_ptr<Task> task;
+        int priority;
+        int weight;
+    };
+
+    /// Work left once a task is finished, done after @m_tasksMtx is unlocked
+    struct Completion {
+        TaskState state = TaskState::TS_Finished;
+        std::vector<Callback> callbacks;
+        std::vector<ReadyTask> ready; ///< Successors to submit
+        std::vector<std::pair<ThreadManager *, int>> helpers; ///< Workers to wake from helpUntil, with their pool
+    };
+
+    /// Create the executor of the task and hand it to the thread manager
+    void submit(TaskID id, ExecutorType type, std::unique_ptr<Task> task, int priority, int weight);
+
+    /// Called on the worker thread that retired the executor of @task
+    void onExecutorFinished(TaskID task, Executor *executor);
+
+    /// Cancel the executor of @task, the record must have been counted in TaskRecord::cancelling
+    void cancelExecutor(TaskID task, Executor *executor);
+
+    /// Mark the task as finished with @state and release its successors and waiters, must be called with
+    /// @m_tasksMtx locked, the rest is done by @complete
+    void unlockedFinish(TaskID task, TaskState state, Completion &completion);
+
+    /// Wake the waiters, submit the successors and call the callbacks collected by @unlockedFinish
+    void complete(TaskID task, Completion &completion);
+
+    static bool isDone(TaskState state) {
+        return state == TaskState::TS_Finished || state == TaskState::TS_Cancelled || state == TaskState::TS_Expired;
+    }
+
+    /// Bind the parameters of @task to the schema of @type, using the named lookups if the task did not bind them
+    void resolveParams(ExecutorType type, Task &task) const;
+
+    /// Library found by ScanPlugins
+    struct Plugin {
+        explicit Plugin(std::string path) : path(std::move(path)) {}
+
+        std::string path;
+        std::once_flag loaded; ///< Loaded once, by the first task that needs it or the prewarm
+    };
+
+    /// Get the handle of @executorName, a new one without a constructor if the name is not known yet
+    ExecutorType addExecutorType(const std::string &executorName);
+
+    /// Load the library @type was scanned from unless it is loaded already, waits for a load in progress
+    void loadPlugin(ExecutorType type);
+    void loadPlugin(Plugin &plugin);
+
+    /// Register @waiter in the record of each unfinished task, must be called with @m_tasksMtx locked
+    void unlockedAddWaiter(std::span<const TaskID> tasks, Waiter &waiter);
+
+    /// Set @waiter.worker and @waiter.pool if the calling thread is a worker of either pool
+    void setWaitingWorker(Waiter &waiter);
+
+    /// Wait until @waiter.remaining is 0, @lock is released while waiting and locked again on return
+    void wait(std::unique_lock<std::mutex> &lock, Waiter &waiter);
+
     static TaskSystemExecutor *self;
-    std::map<std::string, ExecutorConstructor> m_executors;
-    std::priority_queue<std::unique_ptr<Task>, std::vector<std::unique_ptr<Task>>, PriorityComparator> m_priority_queue;
+    static constexpr int maxExecutorTypes = 256;
+    std::map<std::string, ExecutorType> m_executors; ///< Handle of each registered or scanned name
+    /// Protects @m_executors and the increments of @m_executorTypeCount, a library loaded by the first task
+    /// of one of its executors registers them while other threads look names up
+    mutable std::shared_mutex m_executorsMtx;
+    /// Constructor for each handle, fixed size so workers creating executors never see it reallocated
+    std::unique_ptr<std::atomic<ExecutorConstructor>[]> m_constructors;
+    std::unique_ptr<ParamSchema[]> m_schemas; ///< Schema for each handle, fixed size for the same reason
+    std::unique_ptr<ExecutorClass[]> m_classes; ///< Pool of each handle, written before the constructor is published
+    std::unique_ptr<int[]> m_pluginOf; ///< Index in @m_plugins of the library each handle was scanned from, or -1
+    std::vector<std::unique_ptr<Plugin>> m_plugins; ///< Never removed, loads keep pointers to them
+    std::atomic<int> m_executorTypeCount = 0;
     ThreadManager& tm;
+    ThreadManager& blocking; ///< Pool for the EC_Blocking executors
+
+    /// Outcome of a task, kept once its record is removed
+    struct FinishedTask {
+        uint64_t id = 0;
+        TaskState state = TaskState::TS_Finished;
+        std::chrono::steady_clock::time_point finishTime;
+    };
+
+    /// Number of recently finished tasks whose state and finish time are kept
+    static constexpr int finishedHistory = 4096;
+
+    std::mutex m_tasksMtx; ///< Protects @m_tasks, @m_finished and all the records
+    std::unordered_map<uint64_t, TaskRecord> m_tasks; ///< Record for each task that is not finished yet
+    /// Last tasks to finish, indexed with the id modulo @finishedHistory, a newer task overwrites an older one
+    std::unique_ptr<FinishedTask[]> m_finished;
 };
 
 };
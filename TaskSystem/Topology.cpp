@@ -0,0 +1,300 @@
+#include "Topology.h"
+
+#include <map>
+#include <new>
+#include <string>
+#include <thread>
+#include <cctype>
+#include <cassert>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#if defined(_WIN32) || defined(_WIN64)
+#define USE_WIN
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#elif defined(__linux__)
+#define USE_LINUX
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+namespace TaskSystem {
+
+#ifdef USE_LINUX
+/// Parse a sysfs CPU list such as "0-3,8,10-11"
+static std::vector<int> parseCpuList(const std::string &list) {
+    std::vector<int> result;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        const std::string range = list.substr(pos, end - pos);
+        const size_t dash = range.find('-');
+        try {
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) {
+                result.push_back(cpu);
+            }
+        } catch (const std::exception &) {
+            // trailing newline or garbage, nothing to add
+        }
+        pos = end + 1;
+    }
+    return result;
+}
+
+static int readInt(const std::string &path, int fallback) {
+    std::ifstream file(path);
+    int value = fallback;
+    if (!(file >> value)) {
+        return fallback;
+    }
+    return value;
+}
+
+/// The cpuN directory contains a nodeM link for the NUMA node of the CPU
+static int readNode(int cpu) {
+    std::error_code error;
+    const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(dir, error)) {
+        const std::string name = entry.path().filename().string();
+        if (name.size() > 4 && name.compare(0, 4, "node") == 0 && std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+            return std::stoi(name.substr(4));
+        }
+    }
+    return 0;
+}
+#endif
+
+Topology::Topology() {
+#ifdef USE_LINUX
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    std::ifstream onlineFile("/sys/devices/system/cpu/online");
+    std::string online;
+    std::getline(onlineFile, online);
+    for (int cpu : parseCpuList(online)) {
+        if (haveMask && (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed))) {
+            continue;
+        }
+        const std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        CpuInfo info;
+        info.cpu = cpu;
+        info.core = readInt(topology + "core_id", cpu);
+        info.package = readInt(topology + "physical_package_id", 0);
+        info.node = readNode(cpu);
+        cpus.push_back(info);
+    }
+#endif
+
+    if (cpus.empty()) {
+        const int count = std::max(1, int(std::thread::hardware_concurrency()));
+        for (int c = 0; c < count; c++) {
+            cpus.push_back(CpuInfo{c, c, 0, 0});
+        }
+    }
+    for (const CpuInfo &info : cpus) {
+        nodeCount = std::max(nodeCount, info.node + 1);
+    }
+}
+
+const Topology &Topology::GetSystem() {
+    static const Topology system;
+    return system;
+}
+
+std::vector<CpuInfo> Topology::CompactOrder() const {
+    std::vector<CpuInfo> order = cpus;
+    std::sort(order.begin(), order.end(), [](const CpuInfo &a, const CpuInfo &b) {
+        if (a.node != b.node) {
+            return a.node < b.node;
+        }
+        if (a.package != b.package) {
+            return a.package < b.package;
+        }
+        if (a.core != b.core) {
+            return a.core < b.core;
+        }
+        return a.cpu < b.cpu;
+    });
+    return order;
+}
+
+std::vector<CpuInfo> Topology::ScatterOrder() const {
+    // rank of each CPU among the SMT siblings of its core, the first hardware thread of every core goes first
+    std::map<int, std::vector<std::pair<int, CpuInfo>>> nodes;
+    std::map<std::pair<int, int>, int> siblings;
+    for (const CpuInfo &info : CompactOrder()) {
+        const int rank = siblings[{info.package, info.core}]++;
+        nodes[info.node].push_back({rank, info});
+    }
+    for (auto &[node, list] : nodes) {
+        std::stable_sort(list.begin(), list.end(), [](const std::pair<int, CpuInfo> &a, const std::pair<int, CpuInfo> &b) {
+            return a.first < b.first;
+        });
+    }
+
+    // round robin over the nodes
+    std::vector<CpuInfo> order;
+    for (size_t index = 0; order.size() < cpus.size(); index++) {
+        for (auto &[node, list] : nodes) {
+            if (index < list.size()) {
+                order.push_back(list[index].second);
+            }
+        }
+    }
+    return order;
+}
+
+std::vector<ThreadPlacement::Worker> ThreadPlacement::Resolve(const Topology &topology) const {
+    const std::vector<CpuInfo> &cpuInfos = topology.GetCpus();
+    std::vector<Worker> workers;
+    switch (policy) {
+    case TP_None:
+        workers.resize(threadCount > 0 ? threadCount : cpuInfos.size());
+        break;
+    case TP_Compact:
+    case TP_Scatter: {
+        const std::vector<CpuInfo> order = policy == TP_Compact ? topology.CompactOrder() : topology.ScatterOrder();
+        workers.resize(threadCount > 0 ? threadCount : order.size());
+        for (int c = 0; c < int(workers.size()); c++) {
+            const CpuInfo &info = order[c % order.size()];
+            workers[c].cpus = {info.cpu};
+            workers[c].node = info.node;
+        }
+        break;
+    }
+    case TP_PerNode: {
+        std::map<int, std::vector<int>> nodeCpus;
+        for (const CpuInfo &info : cpuInfos) {
+            nodeCpus[info.node].push_back(info.cpu);
+        }
+        std::vector<std::pair<int, std::vector<int>>> nodes(nodeCpus.begin(), nodeCpus.end());
+        workers.resize(threadCount > 0 ? threadCount : cpuInfos.size());
+        // contiguous blocks of thread indices share a node
+        for (int c = 0; c < int(workers.size()); c++) {
+            const std::pair<int, std::vector<int>> &node = nodes[size_t(c) * nodes.size() / workers.size()];
+            workers[c].cpus = node.second;
+            workers[c].node = node.first;
+        }
+        break;
+    }
+    case TP_CpuList: {
+        assert(!cpus.empty() && "No CPUs given");
+        workers.resize(threadCount > 0 ? threadCount : cpus.size());
+        for (int c = 0; c < int(workers.size()); c++) {
+            const int cpu = cpus[c % cpus.size()];
+            workers[c].cpus = {cpu};
+            for (const CpuInfo &info : cpuInfos) {
+                if (info.cpu == cpu) {
+                    workers[c].node = info.node;
+                }
+            }
+        }
+        break;
+    }
+    }
+    return workers;
+}
+
+bool PinCurrentThread(const std::vector<int> &cpus) {
+    if (cpus.empty()) {
+        return true;
+    }
+#if defined(USE_LINUX)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(USE_WIN)
+    DWORD_PTR mask = 0;
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < int(sizeof(mask) * 8)) {
+            mask |= DWORD_PTR(1) << cpu;
+        }
+    }
+    return mask && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+    // no thread affinity API, the OS keeps placing the threads
+    return true;
+#endif
+}
+
+#ifdef USE_LINUX
+static size_t pageRound(size_t bytes) {
+    const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    return (std::max<size_t>(bytes, 1) + page - 1) / page * page;
+}
+#endif
+
+void *Topology::AllocateOnNode(size_t bytes, int node) {
+#ifdef USE_LINUX
+    const size_t length = pageRound(bytes);
+    void *ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+
+    const int nodeCount = GetSystem().GetNodeCount();
+    if (nodeCount > 1 && node < nodeCount) {
+        // the policy applies when the pages are first touched, failing to set it only loses the placement
+        const int bits = sizeof(unsigned long) * 8;
+        std::vector<unsigned long> mask((nodeCount + bits - 1) / bits, 0);
+        for (int c = 0; c < nodeCount; c++) {
+            if (node < 0 || c == node) {
+                mask[c / bits] |= 1ul << (c % bits);
+            }
+        }
+        const int mode = node < 0 ? MPOL_INTERLEAVE : MPOL_PREFERRED;
+        syscall(SYS_mbind, ptr, length, mode, mask.data(), mask.size() * bits + 1, 0);
+    }
+    return ptr;
+#else
+    return ::operator new(bytes, std::align_val_t(4096), std::nothrow);
+#endif
+}
+
+void Topology::FreeOnNode(void *ptr, size_t bytes) {
+    if (!ptr) {
+        return;
+    }
+#ifdef USE_LINUX
+    munmap(ptr, pageRound(bytes));
+#else
+    ::operator delete(ptr, std::align_val_t(4096));
+#endif
+}
+
+void *NodeMemoryResource::do_allocate(size_t bytes, size_t alignment) {
+    assert(alignment <= 4096 && "Node allocations are page aligned");
+    void *ptr = Topology::AllocateOnNode(bytes, node);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void NodeMemoryResource::do_deallocate(void *ptr, size_t bytes, size_t) {
+    Topology::FreeOnNode(ptr, bytes);
+}
+
+bool NodeMemoryResource::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+    const NodeMemoryResource *resource = dynamic_cast<const NodeMemoryResource *>(&other);
+    return resource && resource->node == node;
+}
+
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <memory_resource>
+
+namespace TaskSystem {
+
+/// Logical CPU the process is allowed to run on
+struct CpuInfo {
+    int cpu = 0; ///< Id used by the OS for affinity
+    int core = 0; ///< Physical core, SMT siblings share it
+    int package = 0; ///< Socket
+    int node = 0; ///< NUMA node, 0 if the system does not report nodes
+};
+
+/// CPUs of the machine, detected once from the OS
+/// On Linux it is read from sysfs and limited to the affinity mask of the process, elsewhere a single node
+/// with one core for each hardware thread is assumed
+class Topology {
+public:
+    static const Topology &GetSystem();
+
+    const std::vector<CpuInfo> &GetCpus() const { return cpus; }
+    int GetNodeCount() const { return nodeCount; }
+
+    /// CPUs ordered so consecutive entries share a core, then a package, then a node
+    std::vector<CpuInfo> CompactOrder() const;
+
+    /// CPUs ordered so consecutive entries are on different nodes, then different cores, SMT siblings come last
+    std::vector<CpuInfo> ScatterOrder() const;
+
+    /// Allocate memory placed on @node, or interleaved page by page over all nodes if @node is -1
+    /// Falls back to plain allocation where placement is not supported, see NodeMemoryResource
+    static void *AllocateOnNode(size_t bytes, int node);
+    static void FreeOnNode(void *ptr, size_t bytes);
+
+private:
+    Topology();
+
+    std::vector<CpuInfo> cpus;
+    int nodeCount = 1;
+};
+
+/// How worker threads are placed on the CPUs, passed to TaskSystemExecutor::Init
+struct ThreadPlacement {
+    enum Policy {
+        TP_None, ///< Threads are not pinned, the OS places them
+        TP_Compact, ///< Each thread pinned to one CPU, filling a core, then a package, then a node before the next
+        TP_Scatter, ///< Each thread pinned to one CPU, spread over the nodes and cores
+        TP_PerNode, ///< Threads split evenly over the nodes, each one free to run on any CPU of its node
+        TP_CpuList, ///< Thread i pinned to @cpus[i % cpus.size()]
+    };
+
+    Policy policy = TP_None;
+    int threadCount = 0; ///< 0 uses one thread for each CPU the policy covers
+    std::vector<int> cpus; ///< OS CPU ids for TP_CpuList
+
+    static ThreadPlacement Unpinned(int threadCount) { return ThreadPlacement{TP_None, threadCount, {}}; }
+    static ThreadPlacement Compact(int threadCount = 0) { return ThreadPlacement{TP_Compact, threadCount, {}}; }
+    static ThreadPlacement Scatter(int threadCount = 0) { return ThreadPlacement{TP_Scatter, threadCount, {}}; }
+    static ThreadPlacement PerNode(int threadCount = 0) { return ThreadPlacement{TP_PerNode, threadCount, {}}; }
+    static ThreadPlacement CpuList(std::vector<int> cpus) { return ThreadPlacement{TP_CpuList, int(cpus.size()), std::move(cpus)}; }
+
+    /// Where a single worker runs
+    struct Worker {
+        std::vector<int> cpus; ///< Allowed CPUs, empty if not pinned
+        int node = 0;
+    };
+
+    /// Resolve the policy against @topology
+    std::vector<Worker> Resolve(const Topology &topology) const;
+};
+
+/// Pin the calling thread to @cpus, does nothing if the list is empty or the platform does not support it
+/// @return false if the OS refused the affinity
+bool PinCurrentThread(const std::vector<int> &cpus);
+
+/// Memory resource placing its allocations on a NUMA node, for large data stepped from many threads such as images
+/// Node -1 interleaves the pages over all nodes, so no single node serves all the threads
+class NodeMemoryResource : public std::pmr::memory_resource {
+public:
+    explicit NodeMemoryResource(int node) : node(node) {}
+
+    int getNode() const { return node; }
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *ptr, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+
+    int node;
+};
+
+};
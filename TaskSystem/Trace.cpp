@@ -0,0 +1,339 @@
+#include "Trace.h"
+#include "LatencyHistogram.h"
+
+#ifdef TS_ENABLE_TRACING
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <cstdio>
+#include <algorithm>
+#include <shared_mutex>
+#include <unordered_set>
+#endif
+
+namespace TaskSystem {
+
+#ifdef TS_ENABLE_TRACING
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Event {
+    int64_t time; ///< Nanoseconds since tracing started
+    uint64_t id;
+    const char *name;
+    TraceEventType type;
+    int32_t arg;
+};
+
+/// Written only by its own thread, counters are atomic so they can be read at any time
+struct ThreadBuffer {
+    int tid = 0; ///< Order of creation, used as the thread id in the trace
+    std::unique_ptr<Event[]> events = std::unique_ptr<Event[]>(new Event[Trace::eventsPerThread]);
+    std::atomic<uint64_t> written = 0; ///< Number of events ever recorded, the last eventsPerThread are kept
+
+    std::atomic<int> workerIndex = -1; ///< ThreadManager thread index, -1 if not a worker
+    std::atomic<int64_t> workerBegin = 0;
+    std::atomic<int64_t> workerEnd = -1; ///< -1 while the worker is running
+
+    /// Steps nest when a worker helps from inside ExecuteStep, deeper ones are counted but not timed
+    static constexpr int maxStepDepth = 32;
+    int64_t stepBegin[maxStepDepth] = {}; ///< Time of the TE_StepBegin of each step running on the thread
+    int stepDepth = 0; ///< Number of steps running on the thread
+    int64_t parkBegin = 0; ///< Time of the last TE_ParkBegin
+
+    std::atomic<uint64_t> steps = 0;
+    std::atomic<uint64_t> steals = 0;
+    std::atomic<uint64_t> parks = 0;
+    std::atomic<uint64_t> wakes = 0;
+    std::atomic<int64_t> busyNs = 0;
+    std::atomic<int64_t> idleNs = 0;
+    LatencyHistogram stepLatency;
+};
+
+struct TraceState {
+    const Clock::time_point start = Clock::now();
+    std::mutex buffersMtx; ///< Protects @buffers, taken only when a thread records its first event
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers; ///< Never freed, the trace can be written after threads exit
+    std::atomic<int> queueDepth = 0;
+    std::atomic<int> maxQueueDepth = 0;
+    std::shared_mutex namesMtx; ///< Protects @names
+    std::unordered_set<std::string> names; ///< Interned names, never removed so the events can point to them
+};
+
+TraceState &state() {
+    static TraceState traceState;
+    return traceState;
+}
+
+thread_local ThreadBuffer *threadBuffer = nullptr;
+
+ThreadBuffer &getThreadBuffer() {
+    if (!threadBuffer) {
+        TraceState &trace = state();
+        std::lock_guard<std::mutex> lock(trace.buffersMtx);
+        trace.buffers.emplace_back(new ThreadBuffer);
+        threadBuffer = trace.buffers.back().get();
+        threadBuffer->tid = int(trace.buffers.size()) - 1;
+    }
+    return *threadBuffer;
+}
+
+int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - state().start).count();
+}
+
+/// Single writer, a plain load and store is enough
+template <typename T>
+void add(std::atomic<T> &counter, T value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void writeEscaped(FILE *file, const char *text) {
+    for (const char *c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', file);
+        }
+        fputc(*c, file);
+    }
+}
+
+void writeEvent(FILE *file, const ThreadBuffer &buffer, const Event &event, bool &first) {
+    const char *name = event.name ? event.name : "executor";
+    const double ts = double(event.time) / 1000.0;
+    const char *ph = nullptr;
+    switch (event.type) {
+    case TE_TaskScheduled: ph = "b"; break;
+    case TE_TaskStarted: ph = "n"; break;
+    case TE_TaskFinished: ph = "e"; break;
+    case TE_StepBegin: case TE_ParkBegin: ph = "B"; break;
+    case TE_StepEnd: case TE_ParkEnd: ph = "E"; break;
+    case TE_Steal: case TE_Wake: ph = "i"; break;
+    case TE_QueueDepth: ph = "C"; break;
+    }
+    const bool async = event.type == TE_TaskScheduled || event.type == TE_TaskStarted || event.type == TE_TaskFinished;
+    if (async && event.id == 0) {
+        // executors run directly on the ThreadManager have no id to match the async events with
+        return;
+    }
+
+    fprintf(file, "%s\n{\"ph\":\"%s\",\"ts\":%.3f,\"pid\":0,\"tid\":%d,\"name\":\"", first ? "" : ",", ph, ts, buffer.tid);
+    first = false;
+    switch (event.type) {
+    case TE_ParkBegin: case TE_ParkEnd: fputs("parked", file); break;
+    case TE_Steal: fputs("steal", file); break;
+    case TE_Wake: fputs("wake", file); break;
+    case TE_QueueDepth: fputs("queue depth", file); break;
+    default: writeEscaped(file, name); break;
+    }
+    fputc('"', file);
+
+    switch (event.type) {
+    case TE_TaskScheduled: case TE_TaskStarted: case TE_TaskFinished:
+        fprintf(file, ",\"cat\":\"task\",\"id\":%llu", (unsigned long long)event.id);
+        break;
+    case TE_StepBegin:
+        fprintf(file, ",\"args\":{\"task\":%llu,\"slot\":%d}", (unsigned long long)event.id, event.arg);
+        break;
+    case TE_Steal:
+        fprintf(file, ",\"s\":\"t\",\"args\":{\"victim\":%d}", event.arg);
+        break;
+    case TE_Wake:
+        fprintf(file, ",\"s\":\"t\",\"args\":{\"worker\":%d}", event.arg);
+        break;
+    case TE_QueueDepth:
+        fprintf(file, ",\"args\":{\"depth\":%d}", event.arg);
+        break;
+    default:
+        break;
+    }
+    fputc('}', file);
+}
+
+}
+
+void Trace::Record(TraceEventType type, uint64_t id, const char *name, int arg) {
+    ThreadBuffer &buffer = getThreadBuffer();
+    const int64_t time = now();
+
+    switch (type) {
+    case TE_StepBegin:
+        if (buffer.stepDepth < ThreadBuffer::maxStepDepth) {
+            buffer.stepBegin[buffer.stepDepth] = time;
+        }
+        buffer.stepDepth++;
+        break;
+    case TE_StepEnd: {
+        const int depth = --buffer.stepDepth;
+        add<uint64_t>(buffer.steps, 1);
+        if (depth < ThreadBuffer::maxStepDepth) {
+            const int64_t took = time - buffer.stepBegin[depth];
+            buffer.stepLatency.add(took);
+            if (depth == 0) {
+                // nested steps run inside this one, their time is already part of it
+                add(buffer.busyNs, took);
+            }
+        }
+        break;
+    }
+    case TE_Steal:
+        add<uint64_t>(buffer.steals, 1);
+        break;
+    case TE_ParkBegin:
+        buffer.parkBegin = time;
+        add<uint64_t>(buffer.parks, 1);
+        break;
+    case TE_ParkEnd:
+        add(buffer.idleNs, time - buffer.parkBegin);
+        break;
+    case TE_Wake:
+        add<uint64_t>(buffer.wakes, 1);
+        break;
+    case TE_QueueDepth: {
+        TraceState &trace = state();
+        trace.queueDepth.store(arg, std::memory_order_relaxed);
+        int max = trace.maxQueueDepth.load(std::memory_order_relaxed);
+        while (max < arg && !trace.maxQueueDepth.compare_exchange_weak(max, arg, std::memory_order_relaxed)) {
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    const uint64_t index = buffer.written.load(std::memory_order_relaxed);
+    buffer.events[index & (eventsPerThread - 1)] = Event{time, id, name, type, arg};
+    buffer.written.store(index + 1, std::memory_order_release);
+}
+
+const char *Trace::Intern(const std::string &name) {
+    TraceState &trace = state();
+    {
+        std::shared_lock<std::shared_mutex> lock(trace.namesMtx);
+        const std::unordered_set<std::string>::const_iterator it = trace.names.find(name);
+        if (it != trace.names.end()) {
+            return it->c_str();
+        }
+    }
+    std::lock_guard<std::shared_mutex> lock(trace.namesMtx);
+    return trace.names.insert(name).first->c_str();
+}
+
+void Trace::BeginWorker(int threadIndex) {
+    ThreadBuffer &buffer = getThreadBuffer();
+    buffer.workerBegin.store(now(), std::memory_order_relaxed);
+    buffer.workerIndex.store(threadIndex, std::memory_order_relaxed);
+}
+
+void Trace::EndWorker() {
+    getThreadBuffer().workerEnd.store(now(), std::memory_order_relaxed);
+}
+
+bool Trace::WriteChromeTrace(const std::string &path) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        printf("Failed to open [%s] for the trace\n", path.c_str());
+        return false;
+    }
+
+    TraceState &trace = state();
+    std::lock_guard<std::mutex> lock(trace.buffersMtx);
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+    bool first = true;
+    for (const std::unique_ptr<ThreadBuffer> &buffer : trace.buffers) {
+        const int workerIndex = buffer->workerIndex.load(std::memory_order_relaxed);
+        fprintf(file, "%s\n{\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"", first ? "" : ",", buffer->tid);
+        first = false;
+        if (workerIndex >= 0) {
+            fprintf(file, "worker %d\"}}", workerIndex);
+        } else {
+            fprintf(file, "thread %d\"}}", buffer->tid);
+        }
+
+        const uint64_t written = buffer->written.load(std::memory_order_acquire);
+        const uint64_t begin = written > uint64_t(eventsPerThread) ? written - eventsPerThread : 0;
+        for (uint64_t c = begin; c < written; c++) {
+            writeEvent(file, *buffer, buffer->events[c & (eventsPerThread - 1)], first);
+        }
+    }
+    fputs("\n]}\n", file);
+    return fclose(file) == 0;
+}
+
+TraceCounters Trace::GetCounters() {
+    TraceCounters counters;
+    TraceState &trace = state();
+    const int64_t time = now();
+    counters.seconds = double(time) * 1e-9;
+    counters.queueDepth = trace.queueDepth.load(std::memory_order_relaxed);
+    counters.maxQueueDepth = trace.maxQueueDepth.load(std::memory_order_relaxed);
+
+    uint64_t histogram[LatencyHistogram::bucketCount] = {};
+    int64_t busyNs = 0;
+    int64_t workerNs = 0;
+    std::lock_guard<std::mutex> lock(trace.buffersMtx);
+    for (const std::unique_ptr<ThreadBuffer> &buffer : trace.buffers) {
+        counters.steps += buffer->steps.load(std::memory_order_relaxed);
+        counters.steals += buffer->steals.load(std::memory_order_relaxed);
+        counters.parks += buffer->parks.load(std::memory_order_relaxed);
+        counters.wakes += buffer->wakes.load(std::memory_order_relaxed);
+        buffer->stepLatency.mergeInto(histogram);
+
+        const int workerIndex = buffer->workerIndex.load(std::memory_order_relaxed);
+        if (workerIndex < 0) {
+            continue;
+        }
+        TraceCounters::Worker worker;
+        worker.threadIndex = workerIndex;
+        worker.steps = buffer->steps.load(std::memory_order_relaxed);
+        worker.busyNs = buffer->busyNs.load(std::memory_order_relaxed);
+        worker.idleNs = buffer->idleNs.load(std::memory_order_relaxed);
+        counters.workers.push_back(worker);
+
+        const int64_t end = buffer->workerEnd.load(std::memory_order_relaxed);
+        busyNs += worker.busyNs;
+        workerNs += (end < 0 ? time : end) - buffer->workerBegin.load(std::memory_order_relaxed);
+    }
+    counters.utilization = workerNs > 0 ? std::min(1.0, double(busyNs) / double(workerNs)) : 0.0;
+
+    counters.p50StepNs = LatencyHistogram::percentile(histogram, 0.5);
+    counters.p99StepNs = LatencyHistogram::percentile(histogram, 0.99);
+    return counters;
+}
+
+bool Trace::IsEnabled() {
+    return true;
+}
+
+#else
+
+void Trace::Record(TraceEventType, uint64_t, const char *, int) {
+}
+
+const char *Trace::Intern(const std::string &) {
+    return nullptr;
+}
+
+void Trace::BeginWorker(int) {
+}
+
+void Trace::EndWorker() {
+}
+
+bool Trace::WriteChromeTrace(const std::string &) {
+    return false;
+}
+
+TraceCounters Trace::GetCounters() {
+    return TraceCounters();
+}
+
+bool Trace::IsEnabled() {
+    return false;
+}
+
+#endif
+
+};
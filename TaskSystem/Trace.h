@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace TaskSystem {
+
+enum TraceEventType : uint32_t {
+	TE_TaskScheduled, ///< Executor handed to the ThreadManager
+	TE_TaskStarted, ///< First step of the executor on any thread
+	TE_TaskFinished, ///< Executor retired, all of its steps returned
+	TE_StepBegin, ///< Worker calls ExecuteStep, arg is the threadIndex of the slot
+	TE_StepEnd, ///< ExecuteStep returned, arg is the ExecStatus
+	TE_Steal, ///< Worker took a slot from another worker, arg is the victim
+	TE_ParkBegin, ///< Worker found nothing to do and parks
+	TE_ParkEnd, ///< Parked worker is running again
+	TE_Wake, ///< Worker woke a parked one, arg is the woken worker
+	TE_QueueDepth, ///< Number of executors waiting for threads, arg is the depth
+};
+
+/// Totals since tracing started, computed from all threads when requested
+struct TraceCounters {
+	struct Worker {
+		int threadIndex = -1;
+		uint64_t steps = 0;
+		int64_t busyNs = 0; ///< Time spent inside ExecuteStep
+		int64_t idleNs = 0; ///< Time spent parked
+	};
+
+	double seconds = 0; ///< Time since the first event
+	double utilization = 0; ///< Share of the worker time spent inside ExecuteStep, in [0, 1]
+	int queueDepth = 0; ///< Queue depth at the last change
+	int maxQueueDepth = 0;
+	uint64_t steps = 0;
+	uint64_t steals = 0;
+	uint64_t parks = 0;
+	uint64_t wakes = 0;
+	int64_t p50StepNs = 0; ///< Approximate, from a log scale histogram
+	int64_t p99StepNs = 0;
+	std::vector<Worker> workers;
+};
+
+/// Scheduler events recorded into per thread ring buffers, enabled with the TS_ENABLE_TRACING compile definition
+/// Recording takes no locks, each thread writes only to its own buffer and the oldest events are overwritten
+/// Without the definition TS_TRACE compiles to nothing and the functions below return empty results
+class Trace {
+public:
+	/// Number of events kept for each thread
+	static constexpr int eventsPerThread = 1 << 16;
+
+	/// Append an event to the buffer of the calling thread
+	/// @param id - TaskID of the task, 0 if the executor was not scheduled through TaskSystemExecutor
+	/// @param name - executor name, must stay valid until the trace is written, see Intern
+	static void Record(TraceEventType type, uint64_t id, const char *name, int arg);
+
+	/// Copy of @name kept until the process exits, equal names share a single copy
+	/// @return nullptr if tracing is compiled out
+	static const char *Intern(const std::string &name);
+
+	/// Mark the calling thread as a worker of the ThreadManager, its time is counted in the utilization
+	static void BeginWorker(int threadIndex);
+
+	/// The calling worker is exiting, its time stops counting
+	static void EndWorker();
+
+	/// Write all buffered events as Chrome trace JSON, viewable in chrome://tracing or ui.perfetto.dev
+	/// Events recorded while writing may be missing or torn, best called while the system is quiet
+	/// @return false if tracing is compiled out or the file can't be written
+	static bool WriteChromeTrace(const std::string &path);
+
+	static TraceCounters GetCounters();
+
+	/// Check if TS_ENABLE_TRACING was defined when the task system was built
+	static bool IsEnabled();
+};
+
+};
+
+#ifdef TS_ENABLE_TRACING
+#define TS_TRACE(type, id, name, arg) ::TaskSystem::Trace::Record(type, id, name, arg)
+#define TS_TRACE_WORKER_BEGIN(threadIndex) ::TaskSystem::Trace::BeginWorker(threadIndex)
+#define TS_TRACE_WORKER_END() ::TaskSystem::Trace::EndWorker()
+#else
+#define TS_TRACE(type, id, name, arg) do {} while (false)
+#define TS_TRACE_WORKER_BEGIN(threadIndex) do {} while (false)
+#define TS_TRACE_WORKER_END() do {} while (false)
+#endif
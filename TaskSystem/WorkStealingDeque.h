@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace TaskSystem {
+
+/// Chase-Lev work stealing deque of pointers
+/// The owning thread pushes and pops at the bottom, any other thread can steal from the top
+/// Implementation follows "Correct and Efficient Work-Stealing for Weak Memory Models", Le et al. 2013
+template <typename T>
+class WorkStealingDeque {
+	/// Circular buffer, replaced by a bigger one when full
+	struct Array {
+		explicit Array(int64_t capacity)
+			: capacity(capacity)
+			, mask(capacity - 1)
+			, items(new std::atomic<T *>[capacity])
+		{}
+
+		T *get(int64_t index) const {
+			return items[index & mask].load(std::memory_order_relaxed);
+		}
+
+		void put(int64_t index, T *item) {
+			items[index & mask].store(item, std::memory_order_relaxed);
+		}
+
+		const int64_t capacity;
+		const int64_t mask;
+		std::unique_ptr<std::atomic<T *>[]> items;
+	};
+public:
+	/// @param capacity - initial capacity, must be power of 2
+	explicit WorkStealingDeque(int64_t capacity = 64) {
+		arrays.emplace_back(new Array(capacity));
+		array.store(arrays.back().get(), std::memory_order_relaxed);
+	}
+
+	WorkStealingDeque(const WorkStealingDeque &) = delete;
+	WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+	/// Add item at the bottom, must be called only by the owner thread
+	void push(T *item) {
+		const int64_t b = bottom.load(std::memory_order_relaxed);
+		const int64_t t = top.load(std::memory_order_acquire);
+		Array *a = array.load(std::memory_order_relaxed);
+		if (b - t > a->capacity - 1) {
+			a = grow(a, t, b);
+		}
+		a->put(b, item);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+	}
+
+	/// Take the most recently pushed item, must be called only by the owner thread
+	/// @return the item or nullptr if the deque is empty
+	T *pop() {
+		const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		Array *a = array.load(std::memory_order_relaxed);
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+
+		T *item = nullptr;
+		if (t <= b) {
+			item = a->get(b);
+			if (t == b) {
+				// last item, race against thieves for it
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+					item = nullptr;
+				}
+				bottom.store(b + 1, std::memory_order_relaxed);
+			}
+		} else {
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return item;
+	}
+
+	/// Take the oldest item, can be called from any thread
+	/// @return the item or nullptr if the deque is empty or another thread won the race for the item
+	T *steal() {
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const int64_t b = bottom.load(std::memory_order_acquire);
+
+		if (t < b) {
+			Array *a = array.load(std::memory_order_acquire);
+			T *item = a->get(t);
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+				return nullptr;
+			}
+			return item;
+		}
+		return nullptr;
+	}
+
+	/// Approximate check, the result can be outdated by the time it is used
+	bool empty() const {
+		return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+	}
+
+private:
+	/// Replace the buffer with one twice the size, old one is kept alive as thieves could still read from it
+	Array *grow(Array *old, int64_t t, int64_t b) {
+		Array *bigger = new Array(old->capacity * 2);
+		for (int64_t c = t; c < b; c++) {
+			bigger->put(c, old->get(c));
+		}
+		arrays.emplace_back(bigger);
+		array.store(bigger, std::memory_order_release);
+		return bigger;
+	}
+
+	alignas(64) std::atomic<int64_t> top = 0;
+	alignas(64) std::atomic<int64_t> bottom = 0;
+	std::atomic<Array *> array;
+	std::vector<std::unique_ptr<Array>> arrays; ///< All buffers ever used, only accessed by the owner
+};
+
+};
@@ -1,8 +1,11 @@
 #include "TaskSystem.h"
+#include "ParallelFor.h"
+#include "Async.h"
 
 #include <cassert>
 #include <chrono>
 #include <thread>
+#include <fstream>
 
 
 using namespace TaskSystem;
@@ -40,53 +43,278 @@ struct RaytracerParams : Task {
 void testRenderer() {
     TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
 
-#if defined(_WIN32) || defined(_WIN64)
-    const bool libLoaded = ts.LoadLibrary("libRaytracerExecutor.dll");
-#elif defined(__APPLE__)
-    const bool libLoaded = ts.LoadLibrary("libRaytracerExecutor.dylib");
-#elif defined(__linux__)
-    const bool libLoaded = ts.LoadLibrary("../libRaytracerExecutor.so");
-#endif
-    assert(libLoaded);
     std::unique_ptr<Task> task = std::make_unique<RaytracerParams>("Example");
 
     TaskID id = ts.ScheduleTask(std::move(task), 1);
     ts.WaitForTask(id);
 }
 
-void testPrinter() {
+/// Busy loop over @count items that each take @spinUs microseconds of CPU time
+struct SpinTask : Task {
+    int count;
+    int spinUs;
+
+    SpinTask(int count, int spinUs): count(count), spinUs(spinUs) {}
+    virtual std::string GetExecutorName() const { return "spin"; }
+};
+
+void registerSpin() {
+    TaskSystemExecutor::GetInstance().Register("spin", [](std::unique_ptr<Task> task) -> Executor * {
+        const SpinTask &spin = static_cast<const SpinTask &>(*task);
+        const std::chrono::microseconds spinTime(spin.spinUs);
+        return MakeParallelFor(std::move(task), 0, spin.count, [spinTime](int64_t, int) {
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            while (std::chrono::steady_clock::now() - start < spinTime) {
+            }
+        });
+    });
+}
+
+void testPreemption() {
     TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
-#if defined(_WIN32) || defined(_WIN64)
-    const bool libLoaded = ts.LoadLibrary("PrinterExecutor.dll");
-#elif defined(__APPLE__)
-    const bool libLoaded = ts.LoadLibrary("libPrinterExecutor.dylib");
-#elif defined(__linux__)
-    const bool libLoaded = ts.LoadLibrary("../libPrinterExecutor.so");
-#endif
-    assert(libLoaded);
+
+    // a compute executor, preemption decides which task the compute workers step next
+    registerSpin();
 
     // two instances of the same task
-    std::unique_ptr<Task> p1 = std::make_unique<PrinterParams>(100, 25);
-    std::unique_ptr<Task> p2 = std::make_unique<PrinterParams>(100, 25);
+    std::unique_ptr<Task> p1 = std::make_unique<SpinTask>(300, 1000);
+    std::unique_ptr<Task> p2 = std::make_unique<SpinTask>(300, 1000);
 
     // give some time for the first task to execute
     TaskID id1 = ts.ScheduleTask(std::move(p1), 10);
-    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
     // insert bigger priority task, TaskSystem should switch to it
     TaskID id2 = ts.ScheduleTask(std::move(p2), 20);
 
-    ts.OnTaskCompleted(id1, [](TaskID id) {
+    ts.OnTaskCompleted(id1, [](TaskID) {
         printf("Task 1 finished\n");
     });
     ts.WaitForTask(id2);
     ts.WaitForTask(id1);
+
+    // the first task lost its threads to the second one, so it is left with the rest of its work
+    assert(*ts.GetTaskFinishTime(id2) < *ts.GetTaskFinishTime(id1));
+}
+
+void testGraph() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    // diamond: both middle tasks start once the first is done, the last one once both middle ones are done
+    TaskGraph graph;
+    const int first = graph.Add(std::make_unique<PrinterParams>(10, 10), 10);
+    const int left = graph.Add(std::make_unique<PrinterParams>(20, 10), 10, {first});
+    const int right = graph.Add(std::make_unique<PrinterParams>(20, 10), 10, {first});
+    const int last = graph.Add(std::make_unique<PrinterParams>(10, 10), 10, {left, right});
+
+    std::vector<TaskID> ids = ts.ScheduleGraph(std::move(graph));
+    ts.OnTaskCompleted(ids[first], [](TaskID) {
+        printf("First task finished\n");
+    });
+    ts.WaitForTask(ids[last]);
+}
+
+void testParamTasks() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    // names are resolved once, the tasks are filled through the slots
+    const ExecutorType printer = ts.FindExecutorType("printer");
+    const ParamSchema &schema = ts.GetSchema(printer);
+    const ParamSlot<int> max{schema.Find("max")};
+    const ParamSlot<int> sleep{schema.Find("sleep")};
+    assert(max.IsValid() && sleep.IsValid());
+
+    std::vector<TaskID> ids;
+    for (int c = 0; c < 8; c++) {
+        std::unique_ptr<ParamTask> task = ts.MakeTask(printer);
+        task->Set(max, 5 + c).Set(sleep, 5);
+        ids.push_back(ts.ScheduleTask(printer, std::move(task), c));
+    }
+    ts.WaitForAll(ids);
+}
+
+/// Sum of [begin, end), split in two child tasks that are joined from inside the step until the range is small
+struct NestedSumTask : Task {
+    int64_t begin;
+    int64_t end;
+    int64_t *result;
+
+    NestedSumTask(int64_t begin, int64_t end, int64_t *result): begin(begin), end(end), result(result) {}
+    virtual std::string GetExecutorName() const { return "nested-sum"; }
+};
+
+struct NestedSumExecutor : Executor {
+    NestedSumExecutor(std::unique_ptr<Task> taskToExecute) : Executor(std::move(taskToExecute)) {}
+
+    virtual ExecStatus ExecuteStep(int, int) {
+        if (claimed.exchange(true)) {
+            return ES_Stop;
+        }
+        const NestedSumTask &sum = static_cast<const NestedSumTask &>(*task);
+        if (sum.end - sum.begin <= 1000) {
+            // leaves use a nested parallel reduce, waited for on this worker the same way
+            int64_t *result = sum.result;
+            std::unique_ptr<Executor> leaf(MakeParallelReduce<int64_t>(nullptr, sum.begin, sum.end, 0,
+                [](int64_t &value, int64_t index) { value += index; },
+                [](int64_t &into, int64_t from) { into += from; },
+                [result](int64_t total) { *result = total; }));
+            ThreadManager::GetInstance().runThreads(*leaf);
+            return ES_Stop;
+        }
+
+        TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+        const int64_t middle = sum.begin + (sum.end - sum.begin) / 2;
+        int64_t left = 0;
+        int64_t right = 0;
+        const TaskID children[2] = {
+            ts.ScheduleTask(std::make_unique<NestedSumTask>(sum.begin, middle, &left), task->GetPriority()),
+            ts.ScheduleTask(std::make_unique<NestedSumTask>(middle, sum.end, &right), task->GetPriority()),
+        };
+        ts.WaitForAll(children);
+        *sum.result = left + right;
+        return ES_Stop;
+    }
+
+    std::atomic<bool> claimed = false;
+};
+
+void registerNestedSum() {
+    TaskSystemExecutor::GetInstance().Register("nested-sum", [](std::unique_ptr<Task> task) -> Executor * {
+        return new NestedSumExecutor(std::move(task));
+    });
+}
+
+void testNestedTasks() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    registerNestedSum();
+
+    const int64_t count = 1 << 20;
+    int64_t result = 0;
+    ts.WaitForTask(ts.ScheduleTask(std::make_unique<NestedSumTask>(0, count, &result), 0));
+    printf("Nested sum %lld, expected %lld\n", (long long)result, (long long)(count * (count - 1) / 2));
+    assert(result == count * (count - 1) / 2);
+}
+
+/// Sum of the indices of all bytes of a file, -1 if it can't be read
+struct FileSumTask : Task {
+    std::string path;
+    int64_t *result;
+
+    FileSumTask(const std::string &path, int64_t *result): path(path), result(result) {}
+    virtual std::string GetExecutorName() const { return "file-sum"; }
+};
+
+/// Reads the file and sums with a nested-sum task, the executor holds no worker while waiting for either
+struct FileSumExecutor : AsyncExecutor {
+    FileSumExecutor(std::unique_ptr<Task> taskToExecute) : AsyncExecutor(std::move(taskToExecute)) {}
+
+    AsyncBody Run() override {
+        const FileSumTask &fileSum = static_cast<const FileSumTask &>(*task);
+        const std::optional<std::string> contents = co_await ReadFile(fileSum.path);
+        if (!contents) {
+            *fileSum.result = -1;
+            co_return;
+        }
+
+        int64_t sum = 0;
+        co_await TaskSystemExecutor::GetInstance().ScheduleTask(
+            std::make_unique<NestedSumTask>(0, int64_t(contents->size()), &sum), task->GetPriority());
+        co_await YieldPoint();
+        *fileSum.result = sum;
+    }
+};
+
+void testAsyncTasks() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    registerNestedSum();
+    ts.Register("file-sum", [](std::unique_ptr<Task> task) -> Executor * {
+        return new FileSumExecutor(std::move(task));
+    });
+
+    const int64_t size = 100000;
+    const std::string path = "TaskSystem.async.bin";
+    std::ofstream(path, std::ios::binary) << std::string(size, 'x');
+
+    std::vector<int64_t> results(16, 0);
+    std::vector<TaskID> ids;
+    for (int64_t &result : results) {
+        ids.push_back(ts.ScheduleTask(std::make_unique<FileSumTask>(path, &result), 0));
+    }
+    ts.WaitForAll(ids);
+    for (int64_t result : results) {
+        assert(result == size * (size - 1) / 2);
+    }
+    printf("Async file sums %lld, expected %lld\n", (long long)results[0], (long long)(size * (size - 1) / 2));
+    std::remove(path.c_str());
+}
+
+void testCancelTasks() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    ts.SetSchedulingPolicy(SP_EarliestDeadline);
+
+    // the one with the deadline stops on its own, the other one and its successor are cancelled
+    const auto now = std::chrono::steady_clock::now();
+    std::unique_ptr<Task> expiring = std::make_unique<PrinterParams>(1000, 10);
+    expiring->SetDeadline(now + std::chrono::milliseconds(100));
+    const TaskID ids[2] = {
+        ts.ScheduleTask(std::move(expiring), 10),
+        ts.ScheduleTask(std::make_unique<PrinterParams>(1000, 10), 10),
+    };
+    const TaskID after[1] = {ids[1]};
+    const TaskID successor = ts.ScheduleTask(std::make_unique<PrinterParams>(10, 10), 10, after);
+
+    std::atomic<int> cancelled = 0;
+    std::atomic<int> expired = 0;
+    for (TaskID id : {ids[0], ids[1], successor}) {
+        ts.OnTaskCompleted(id, [&cancelled, &expired](TaskID, TaskState state) {
+            cancelled += state == TaskState::TS_Cancelled;
+            expired += state == TaskState::TS_Expired;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ts.CancelTask(successor);
+    ts.CancelTask(ids[1]);
+    ts.WaitForAll(ids);
+    ts.WaitForTask(successor);
+    printf("Cancelled %d, expired %d\n", cancelled.load(), expired.load());
+    assert(cancelled == 2 && expired == 1);
+    ts.SetSchedulingPolicy(SP_Weighted);
 }
 
 int main(int argc, char *argv[]) {
     TaskSystemExecutor::Init(4);
 
-    testRenderer();
+    // executor libraries are loaded by the first task for them, installed ones take precedence over the build tree
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+    if (ts.ScanPlugins(TS_EXECUTOR_PATH) == 0) {
+        ts.ScanPlugins(TS_PLUGIN_DIR);
+    }
+
+    testPreemption();
+    testGraph();
+    testParamTasks();
+    testNestedTasks();
+    testAsyncTasks();
+    testCancelTasks();
+
+    // the raytracer is only built when its submodule is checked out
+    if (ts.FindExecutorType("raytracer").IsValid()) {
+        testRenderer();
+    } else {
+        printf("Raytracer executor not found, skipping testRenderer\n");
+    }
+
+    // only with TS_ENABLE_TRACING, open the file in chrome://tracing or ui.perfetto.dev
+    if (Trace::IsEnabled() && Trace::WriteChromeTrace("TaskSystem.trace.json")) {
+        const TraceCounters counters = Trace::GetCounters();
+        printf("Utilization %.1f%%, %llu steps, p50 %lldns, p99 %lldns, %llu steals, max queue depth %d\n",
+            counters.utilization * 100, (unsigned long long)counters.steps, (long long)counters.p50StepNs,
+            (long long)counters.p99StepNs, (unsigned long long)counters.steals, counters.maxQueueDepth);
+    }
 
     return 0;
 }
\ No newline at end of file